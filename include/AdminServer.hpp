@@ -0,0 +1,58 @@
+#ifndef ADMINSERVER_HPP
+#define ADMINSERVER_HPP
+
+#include <vector>
+#include <string>
+#include <sys/types.h>
+#include "EventPoller.hpp"
+#include "EventLoop.hpp"
+
+// line-based control channel on a unix socket, serviced by the first event loop
+class AdminServer
+{
+private:
+	struct Connection : public EventSource
+	{
+		int             fd;
+		std::string     input;
+		std::string     output;
+		bool            closing;
+		bool            writing;
+
+		Connection(int connectionFd);
+	};
+
+	std::string                 _path;
+	int                         _fd;
+	ino_t                       _inode;
+	EventSource                 _listener;
+	EventPoller*                _poller;
+	std::vector<EventLoop*>     _loops;
+	pid_t                       _controlPid;
+	std::vector<Connection*>    _connections;
+
+	AdminServer(const AdminServer&);
+	AdminServer& operator=(const AdminServer&);
+
+public:
+	AdminServer(const std::string& path, const std::vector<EventLoop*>& loops, pid_t controlPid);
+	~AdminServer();
+
+	void handleEvent(EventSource* source, uint32_t events);
+
+private:
+	void acceptConnection();
+	void readCommands(Connection* connection);
+	void flush(Connection* connection);
+	void closeConnection(Connection* connection);
+	std::string execute(const std::string& line, bool& closing);
+
+	std::string help() const;
+	std::string getTunables() const;
+	std::string setTunable(const std::string& name, const std::string& value);
+	std::string setLogLevel(const std::string& name);
+	std::string controlLoops(EventLoop::Control command);
+	std::string signalServer(int signum, const std::string& action);
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <vector>
+#include <cstddef>
+
+class BufferPool
+{
+private:
+	size_t              _bufferSize;
+	size_t              _maxFree;
+	size_t              _inUse;
+	std::vector<char*>  _free;
+
+	BufferPool(const BufferPool&);
+	BufferPool& operator=(const BufferPool&);
+
+public:
+	BufferPool(size_t bufferSize, size_t maxFree);
+	~BufferPool();
+
+	char* acquire();
+	void release(char* buffer);
+	size_t getBufferSize() const;
+	size_t getBytesInUse() const;
+	size_t getBytesCached() const;
+	size_t trim();
+};
+
+#endif
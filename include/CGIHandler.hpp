@@ -20,7 +20,6 @@ public:
 
 	bool isRunning(int& status);
 	void killProcess();
-	bool hasTimedOut();
 
 	time_t getStartTime() const;
 	std::string getOutputFile() const;
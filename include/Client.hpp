@@ -5,36 +5,143 @@
 #include <vector>
 #include <ctime>
 #include <cstring>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "HTTPRequest.hpp"
 #include "HTTPResponse.hpp"
 #include "ServerConfig.hpp"
+#include "ServerSet.hpp"
+#include "TimerWheel.hpp"
+#include "EventPoller.hpp"
+#include "BufferPool.hpp"
+#include "IdleList.hpp"
+#include "RateLimiter.hpp"
+#include "TokenBucket.hpp"
+#include "TlsContext.hpp"
+#include "Http2Connection.hpp"
 
-class Client
+class Client : public EventSource
 {
 private:
 	int                             _fd;
+	SSL*                            _ssl;
+	Http2Connection*                _http2;
+	bool                            _http2Enabled;
+	RateLimiter*                    _limiter;
+	PeerAddress                     _peer;
+	ServerSet*                      _serverSet;
 	HTTPRequest                     _request;
 	HTTPResponse                    _response;
 	std::string                     _readBuffer;
-	time_t                          _lastActivity;
+	BufferPool*                     _readBuffers;
+	BufferPool*                     _writeBuffers;
+	char*                           _writeBuffer;
+	size_t                          _writeOffset;
+	size_t                          _writeLength;
+	TokenBucket                     _sendBucket;
+	TokenBucket*                    _egress;
+	size_t                          _egressReserved;
+	size_t                          _rateAfter;
+	size_t                          _responseBytes;
+	uint64_t                        _throttleUntil;
+	uint64_t                        _lastActivity;
+	uint64_t                        _requestStart;
+	uint64_t                        _bodyStart;
+	size_t                          _bodyBytes;
+	TimerWheel::Timer               _timer;
+	IdleList::Node                  _idleNode;
+	IdleList::Node                  _runNode;
+	size_t                          _budgetBytes;
+	size_t                          _budgetRequests;
+	size_t                          _requests;
+	size_t                          _keepaliveTimeout;
+	bool                            _edgeTriggered;
+	bool                            _readable;
+	bool                            _readPaused;
+	bool                            _writable;
+	bool                            _responseStarted;
+	bool                            _cork;
+	bool                            _handshaking;
+	bool                            _tlsClean;
+	uint32_t                        _tlsBlocked;
+	size_t                          _tlsRetry;
+	uint32_t                        _interest;
 
 public:
-	Client(int fd, std::vector<ServerConfig>& servers);
+	Client(bool edgeTriggered, BufferPool& readBuffers, BufferPool& writeBuffers);
 	~Client();
 
+	void reinit(int fd, const PeerAddress& peer, ServerSet* serverSet);
+	void release();
+
+	void startTls(SSL* ssl);
+	bool handshake();
+	bool isTls() const;
+	bool isHandshaking() const;
+	bool hasKernelTls() const;
+	uint32_t getTlsBlocked() const;
+	void resumeTls();
+
+	void setHttp2(bool enabled);
+	bool upgradeHttp2();
+	Http2Connection* getHttp2() const;
+	bool hasPendingOutput() const;
+
 	void readRequest();
 	void sendResponse();
 	void reset();
 
+	void startResponse();
+	bool hasStartedResponse() const;
+	bool hasBufferedInput() const;
+	void parseBufferedInput();
+
 	int getFd() const;
-	time_t getLastActivity() const;
+	const PeerAddress& getPeer() const;
+	ServerSet* getServerSet() const;
+	void setServerSet(ServerSet* serverSet);
+	uint64_t getLastActivity() const;
+	TimerWheel::Timer* getTimer();
+	IdleList::Node* getIdleNode();
+	IdleList::Node* getRunNode();
+	void refillBudget();
+	bool hasBudget() const;
+	bool isKeepAliveIdle() const;
+	bool isReceivingBody() const;
+	uint64_t getRequestDeadline() const;
+	void timeoutRequest();
+	void abortCgi();
+	size_t getKeepaliveTimeout() const;
 	HTTPRequest* getRequest();
 	HTTPResponse* getResponse();
 	bool shouldKeepAlive() const;
 
+	bool isReadable() const;
+	bool isReadPaused() const;
+	bool isWritable() const;
+	void setReadable(bool readable);
+	void setWritable(bool writable);
+	bool isThrottled() const;
+	uint64_t getThrottleUntil() const;
+	void resumeSending();
+	void setEgressBucket(TokenBucket* egress);
+	void setRateLimiter(RateLimiter* limiter);
+	void setCork(bool cork);
+	uint32_t getInterest() const;
+	void setInterest(uint32_t events);
+
 	void updateActivity();
+
+private:
+	void releaseWriteBuffer();
+	bool startHttp2();
+	ssize_t receive(char* buffer, size_t size);
+	ssize_t transmit(const char* data, size_t length, int flags);
+	ssize_t checkTls(int result, uint32_t direction);
+	void updateReadPause();
+	size_t getSendAllowance(size_t length);
+	void chargeBudget(size_t bytes);
 };
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef CLIENTPOOL_HPP
+#define CLIENTPOOL_HPP
+
+#include <vector>
+#include <cstddef>
+#include "Client.hpp"
+#include "BufferPool.hpp"
+#include "ServerSet.hpp"
+
+class ClientPool
+{
+private:
+	bool                                _edgeTriggered;
+	BufferPool&                         _readBuffers;
+	BufferPool&                         _writeBuffers;
+	size_t                              _capacity;
+	std::vector<Client*>                _clients;
+	std::vector<Client*>                _free;
+
+	ClientPool(const ClientPool&);
+	ClientPool& operator=(const ClientPool&);
+
+public:
+	ClientPool(size_t capacity, bool edgeTriggered, BufferPool& readBuffers, BufferPool& writeBuffers);
+	~ClientPool();
+
+	Client* acquire(int fd, const PeerAddress& peer, ServerSet* serverSet);
+	void release(Client* client);
+
+	size_t inUse() const;
+	size_t capacity() const;
+	void setCapacity(size_t capacity);
+	size_t trim();
+};
+
+#endif
@@ -14,17 +14,29 @@ public:
 
 	void parseFile();
 	std::vector<ServerConfig> getServers() const;
+	size_t getWorkerThreads() const;
+	size_t getWorkerProcesses() const;
+	bool isEdgeTriggered() const;
+	size_t getMaxEgressRate() const;
+	const std::string& getAdminSocket() const;
 
 private:
 	std::string _configFile;
 	std::vector<ServerConfig> _servers;
+	size_t _workerThreads;
+	size_t _workerProcesses;
+	bool _edgeTriggered;
+	size_t _maxEgressRate;
+	std::string _adminSocket;
 
 	void validateFilePath(const std::string& path);
 	void validateBraces(const std::string& path);
 	void validateServerConflicts() const;
+	void validateWorkerLimits() const;
 
 	void parseServerBlocks(std::ifstream& fileStream);
 	void parseServerBlock(const std::string& block);
+	void parseGlobalDirective(const std::string& line);
 	void parseDirective(const std::string& line, ServerConfig& server);
 	void parseLocationBlock(const std::string& content, LocationConfig& location);
 
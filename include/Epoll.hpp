@@ -3,8 +3,9 @@
 
 #include <sys/epoll.h>
 #include <vector>
+#include "EventPoller.hpp"
 
-class Epoll 
+class Epoll : public EventPoller
 {
 public:
 	Epoll(size_t maxEvents);
@@ -13,15 +14,18 @@ public:
 	Epoll(const Epoll&);
 	Epoll& operator=(const Epoll&);
 
-	bool add(int fd, uint32_t events);
-	bool modify(int fd, uint32_t events);
+	bool add(int fd, uint32_t events, EventSource* source);
+	bool modify(int fd, uint32_t events, EventSource* source);
 	bool remove(int fd);
 	int wait(int timeout = -1);
 	const epoll_event& getEvent(size_t index) const;
+	void invalidate(EventSource* source);
+	const char* getName() const;
 	int getFd() const;
 
 private:
 	int _epollFd;
+	int _ready;
 	std::vector<epoll_event> _events;
 };
 
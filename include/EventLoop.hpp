@@ -0,0 +1,142 @@
+#ifndef EVENTLOOP_HPP
+#define EVENTLOOP_HPP
+
+#include <vector>
+#include <set>
+#include <string>
+#include <ctime>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "ServerConfig.hpp"
+#include "ServerSet.hpp"
+#include "Client.hpp"
+#include "ClientPool.hpp"
+#include "BufferPool.hpp"
+#include "EventPoller.hpp"
+#include "TimerWheel.hpp"
+#include "IdleList.hpp"
+#include "RateLimiter.hpp"
+#include "VhostQuota.hpp"
+#include "TokenBucket.hpp"
+
+class AdminServer;
+
+struct Listener : public EventSource
+{
+	int             fd;
+	size_t          limitConn;
+	bool            cork;
+	bool            http2;
+	TlsContext*     tls;
+	std::string     tooMany;
+	std::string     unavailable;
+
+	Listener(int listenFd);
+};
+
+class EventLoop
+{
+private:
+	EventPoller*                        _poller;
+	int                                 _wakeFd;
+	EventSource                         _wakeSource;
+	volatile bool                       _running;
+	bool                                _paused;
+	uint64_t                            _lastShed;
+	uint32_t                            _listenEvents;
+	bool                                _edgeTriggered;
+	bool                                _limitConns;
+	bool                                _draining;
+	volatile bool                       _drainRequested;
+	ServerSet*                          _serverSet;
+	std::vector<ServerSet*>             _retiredSets;
+	pthread_mutex_t                     _controlLock;
+	pthread_cond_t                      _controlDone;
+	int                                 _controlCommand;
+	bool                                _controlPending;
+	std::string                         _controlResult;
+	AdminServer*                        _admin;
+	size_t                              _index;
+	bool                                _reloadPending;
+	std::vector<ServerConfig>           _pendingServers;
+	std::vector<int>                    _pendingFds;
+	VhostQuota::Table*                  _pendingUsage;
+	std::vector<Listener>               _listeners;
+	BufferPool                          _readBuffers;
+	BufferPool                          _writeBuffers;
+	ClientPool                          _pool;
+	std::vector<Client*>                _clients;
+	std::set<int>                       _cgiPending;
+	TimerWheel                          _timers;
+	IdleList                            _idle;
+	IdleList                            _runQueue;
+	RateLimiter*                        _limiter;
+	TokenBucket*                        _egress;
+	std::vector<TimerWheel::Timer*>     _expired;
+
+	EventLoop(const EventLoop&);
+	EventLoop& operator=(const EventLoop&);
+
+public:
+	enum Control
+	{
+		CONTROL_DUMP,
+		CONTROL_TRIM
+	};
+
+	EventLoop(const std::vector<ServerConfig>& servers, const std::vector<int>& serverFds, uint32_t listenEvents, bool edgeTriggered, VhostQuota::Table* usage, RateLimiter* limiter, TokenBucket* egress);
+	~EventLoop();
+
+	void run();
+	void stop();
+	void drain();
+	void reload(const std::vector<ServerConfig>& servers, const std::vector<int>& serverFds, VhostQuota::Table* usage);
+	void waitReload();
+	std::string control(Control command);
+	std::string runControl(Control command);
+	void setAdmin(AdminServer* admin);
+	void setIndex(size_t index);
+	EventPoller* getPoller();
+	const char* getBackendName() const;
+
+private:
+	void wake();
+	bool setListeners(const std::vector<int>& serverFds);
+	void applyReload();
+	void applyControl();
+	std::string dumpState() const;
+	std::string trimCaches();
+	void beginDrain();
+	void closeIdleClients(uint64_t idleFor);
+	void migrateClient(Client* client);
+	void releaseServerSet(ServerSet* serverSet);
+
+	void handleEvent(const epoll_event& event);
+	void acceptClient(Listener* listener);
+	bool registerClient(int clientFd, const PeerAddress& peer, const Listener* listener);
+	void configureListener(Listener& listener) const;
+	bool evictIdleClient();
+
+	bool isOverloaded() const;
+	bool hasHeadroom() const;
+	void rejectPending(const Listener& listener);
+	void pauseListeners();
+	void checkOverload();
+	void resumeListeners();
+	void processClient(Client* client);
+	void processStreams(Client* client);
+	void suspendClient(Client* client, uint32_t events);
+	void deferClient(Client* client);
+	void runDeferred();
+	void updateInterest(Client* client, uint32_t events);
+	void pollCgiClients();
+
+	int getWaitTimeout() const;
+	uint64_t getDeadline(Client* client) const;
+	void armTimer(Client* client);
+	void expireTimers();
+	void handleTimeout(Client* client);
+	void cleanupClient(Client* client);
+};
+
+#endif
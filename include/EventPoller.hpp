@@ -0,0 +1,38 @@
+#ifndef EVENTPOLLER_HPP
+#define EVENTPOLLER_HPP
+
+#include <sys/epoll.h>
+#include <cstddef>
+
+struct EventSource
+{
+	enum Type
+	{
+		LISTENER,
+		CLIENT,
+		WAKEUP,
+		ADMIN
+	};
+
+	Type    type;
+
+	EventSource(Type sourceType);
+};
+
+class EventPoller
+{
+public:
+	virtual ~EventPoller();
+
+	virtual bool add(int fd, uint32_t events, EventSource* source) = 0;
+	virtual bool modify(int fd, uint32_t events, EventSource* source) = 0;
+	virtual bool remove(int fd) = 0;
+	virtual int wait(int timeout = -1) = 0;
+	virtual const epoll_event& getEvent(size_t index) const = 0;
+	virtual void invalidate(EventSource* source) = 0;
+	virtual const char* getName() const = 0;
+
+	static EventPoller* create(size_t maxEvents);
+};
+
+#endif
@@ -10,6 +10,8 @@
 #include <arpa/inet.h>
 #include "ServerConfig.hpp"
 #include "LocationConfig.hpp"
+#include "RateLimiter.hpp"
+#include "VhostQuota.hpp"
 
 class HTTPRequest
 {
@@ -25,6 +27,7 @@ public:
 		CGI,
 		CHUNKED,
 		MULTIPART,
+		DISCARD,
 		FINISH,
 		ERROR
 	};
@@ -40,16 +43,18 @@ public:
 	enum ChunkState
 	{
 		CHUNK_SIZE,
-		CHUNK_DATA
+		CHUNK_DATA,
+		CHUNK_TRAILER
 	};
 
 private:
-	ServerConfig                        _server;
-	std::vector<ServerConfig>           _servers;
-	LocationConfig                      _location;
+	const ServerConfig*                 _server;
+	const std::vector<ServerConfig>*    _servers;
+	const LocationConfig*               _location;
 	int                                 _statusCode;
 	ParseState                          _state;
 	size_t                              _parsePosition;
+	size_t                              _headerSize;
 	size_t                              _contentLength;
 	std::string                         _method;
 	std::string                         _uri;
@@ -73,13 +78,20 @@ private:
 	std::ofstream                       _uploadFile;
 	size_t                              _totalBodySize;
 	int                                 _client_fd;
+	RateLimiter*                        _limiter;
+	PeerAddress                         _peer;
+	VhostQuota*                         _quota;
+	const ServerConfig*                 _quotaServer;
+	bool                                _quotaCgi;
+	size_t                              _quotaBody;
 
 public:
-	HTTPRequest(std::vector<ServerConfig>& servers);
+	HTTPRequest();
 	~HTTPRequest();
 
 	void parseRequest(std::string& data);
 	bool isComplete() const;
+	bool hasUnreadBody() const;
 	bool keepAlive() const;
 	int getState() const;
 	int getStatusCode() const;
@@ -102,10 +114,14 @@ public:
 	std::string getQueryParameter(const std::string& key) const;
 
 	void setClientfd(int fd);
+	void setPeer(const PeerAddress& peer);
+	void setServers(const std::vector<ServerConfig>& servers);
+	void setRateLimiter(RateLimiter* limiter);
+	void setQuota(VhostQuota* quota);
 
 	bool hasCgi();
 	void clear();
-	std::string getSocketIp(int fd);
+	std::string getSocketIp(int fd, uint16_t& port);
 	const ServerConfig& findServerByHost(const std::string& value);
 
 private:
@@ -116,8 +132,15 @@ private:
 	void parseBody();
 	void parseChunkBody(std::string& data);
 	void parseMultipartBody(std::string& data);
+	bool isMultipart() const;
+	void readMultipartBody(std::string& data);
+	void discardBody(std::string& data);
 
 	bool validateHostHeader();
+	bool validateRateLimit();
+	bool validateQuota();
+	bool acquireQuota(VhostQuota::Resource resource, size_t amount);
+	void releaseQuota();
 	bool validateContentLength();
 	bool validateTransferEncoding();
 	bool validateMultipartFormData();
@@ -126,6 +149,7 @@ private:
 
 	bool readChunkSize(std::string& data);
 	bool readChunkData(std::string& data);
+	bool readChunkTrailer(std::string& data);
 
 	bool processPartHeader(std::string& data);
 	bool processPartData(std::string& data);
@@ -14,20 +14,24 @@ public:
 	~HTTPResponse();
 
 	bool isComplete();
+	void finish();
 	bool isReady();
+	bool hasPendingData() const;
 	void clear();
 
-	ssize_t getResponseChunk(char* buffer);
-	ssize_t getHeaderChunk(char* buffer);
-	ssize_t getContentChunk(char* buffer);
+	ssize_t getResponseChunk(char* buffer, size_t size);
+	ssize_t getHeaderChunk(char* buffer, size_t size);
+	ssize_t getContentChunk(char* buffer, size_t size);
 
 	CGIHandler& getCgiHandler();
 
 	void buildResponse();
 	void buildErrorResponse(int statusCode);
+	static std::string buildRejection(const ServerConfig& server, int statusCode);
 	void buildSuccessResponse(const std::string& fullPath);
 
 	bool isCgiRuning();
+	void abortCgi();
 	void startCgi();
 	void buildCgiResponse();
 	void readCgiFileAndParse(const std::string& filepath);
@@ -44,12 +48,17 @@ public:
 	void setBodyResponse(const std::string& body);
 
 	std::string getHeader() const;
+	const std::map<std::string, std::string>& getHeaders() const;
+	int getStatusCode() const;
+	void skipHeader();
 	std::string getBody() const;
 	std::string getFilePath() const;
 	size_t      getContentLength() const;
 	size_t      getFileSize() const;
 
 	bool shouldKeepAlive() const;
+	void disableKeepAlive();
+
 	void buildHeader();
 
 	void parseCgiResponse(const std::string& chunk);
@@ -78,6 +87,7 @@ private:
 	bool                     _cgiRuning;
 	bool                     _hasCgiOutput;
 	bool                     _cgiHeaderComplete;
+	std::string              _cgiHeaderBuffer;
 	std::string              _cgiFile;
 	std::ifstream 		 _fileStream;
 	std::ofstream            _cgiOutput;
@@ -85,6 +95,7 @@ private:
 	bool                     _headerSent;
 	bool                     _isComplete;
 	bool                     _isReady;
+	bool                     _keepAliveAllowed;
 
 };
 
@@ -0,0 +1,43 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// HPACK header compression, the decoder tracks the peer's dynamic table, the encoder only refers to the static one
+class Hpack
+{
+public:
+	typedef std::pair<std::string, std::string> Header;
+	typedef std::vector<Header> HeaderList;
+
+	Hpack();
+	~Hpack();
+
+	bool decode(const std::string& block, HeaderList& headers, size_t maxSize);
+
+	static void encode(const std::string& name, const std::string& value, std::string& out);
+	static void encodeStatus(int status, std::string& out);
+
+private:
+	Hpack(const Hpack&);
+	Hpack& operator=(const Hpack&);
+
+	std::deque<Header>  _table;
+	size_t              _tableSize;
+	size_t              _maxTableSize;
+
+	bool lookup(size_t index, Header& header) const;
+	void insert(const Header& header);
+	void evict(size_t needed);
+
+	static bool decodeInteger(const std::string& block, size_t& pos, int prefix, size_t& value);
+	static bool decodeString(const std::string& block, size_t& pos, std::string& value);
+	static bool decodeHuffman(const unsigned char* data, size_t length, std::string& out);
+	static void encodeInteger(size_t value, int prefix, unsigned char flags, std::string& out);
+	static size_t findName(const std::string& name);
+};
+
+#endif
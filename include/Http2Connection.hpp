@@ -0,0 +1,151 @@
+#ifndef HTTP2CONNECTION_HPP
+#define HTTP2CONNECTION_HPP
+
+#include <map>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <sys/types.h>
+#include "HTTPRequest.hpp"
+#include "HTTPResponse.hpp"
+#include "ServerSet.hpp"
+#include "RateLimiter.hpp"
+#include "Hpack.hpp"
+
+// HTTP/2 framing for one connection, every stream runs its own HTTPRequest/HTTPResponse pair
+class Http2Connection
+{
+public:
+	enum FrameType
+	{
+		DATA,
+		HEADERS,
+		PRIORITY,
+		RST_STREAM,
+		SETTINGS,
+		PUSH_PROMISE,
+		PING,
+		GOAWAY,
+		WINDOW_UPDATE,
+		CONTINUATION
+	};
+
+	enum ErrorCode
+	{
+		NO_ERROR,
+		PROTOCOL_ERROR,
+		INTERNAL_ERROR,
+		FLOW_CONTROL_ERROR,
+		SETTINGS_TIMEOUT,
+		STREAM_CLOSED,
+		FRAME_SIZE_ERROR,
+		REFUSED_STREAM,
+		CANCEL,
+		COMPRESSION_ERROR,
+		CONNECT_ERROR,
+		ENHANCE_YOUR_CALM
+	};
+
+private:
+	struct Stream
+	{
+		uint32_t        id;
+		HTTPRequest*    request;
+		HTTPResponse*   response;
+		bool            owned;
+		std::string     input;
+		int64_t         sendWindow;
+		int64_t         recvWindow;
+		bool            chunked;
+		bool            remoteClosed;
+		bool            started;
+		bool            headersSent;
+
+		Stream(uint32_t streamId, HTTPRequest* streamRequest, HTTPResponse* streamResponse, bool ownsRequest);
+	};
+
+	int                             _fd;
+	PeerAddress                     _peer;
+	ServerSet*                      _serverSet;
+	RateLimiter*                    _limiter;
+	Hpack                           _decoder;
+	std::map<uint32_t, Stream*>     _streams;
+	std::string                     _output;
+	size_t                          _outputOffset;
+	std::string                     _headerBlock;
+	uint32_t                        _headerStream;
+	bool                            _headerEndStream;
+	uint32_t                        _lastStream;
+	uint32_t                        _cursor;
+	int64_t                         _sendWindow;
+	int64_t                         _recvWindow;
+	int64_t                         _initialWindow;
+	size_t                          _maxFrameSize;
+	size_t                          _requests;
+	size_t                          _keepaliveTimeout;
+	bool                            _prefaceReceived;
+	bool                            _goawaySent;
+	bool                            _goawayReceived;
+	bool                            _failed;
+	bool                            _waiting;
+
+	Http2Connection(const Http2Connection&);
+	Http2Connection& operator=(const Http2Connection&);
+
+public:
+	Http2Connection(int fd, const PeerAddress& peer, ServerSet* serverSet, RateLimiter* limiter);
+	~Http2Connection();
+
+	static bool matchesPreface(const std::string& data);
+	static bool hasPreface(const std::string& data);
+
+	bool upgrade(HTTPRequest* request, HTTPResponse* response);
+	void consume(std::string& input);
+	void process(bool draining);
+	ssize_t getOutputChunk(char* buffer, size_t size);
+	bool hasPendingOutput() const;
+	size_t getQueuedBytes() const;
+	void abortCgi();
+	void closeStreams();
+
+	void setServerSet(ServerSet* serverSet);
+	size_t getStreamCount() const;
+	size_t getKeepaliveTimeout() const;
+	bool isWaiting() const;
+	bool isIdle() const;
+	bool isFinished() const;
+
+private:
+	void handleFrame(int type, int flags, uint32_t id, const char* payload, size_t length);
+	void handleData(int flags, uint32_t id, const char* payload, size_t length);
+	void handleHeaders(int flags, uint32_t id, const char* payload, size_t length);
+	void handleContinuation(int flags, const char* payload, size_t length);
+	void handleSettings(int flags, uint32_t id, const char* payload, size_t length);
+	void handlePing(int flags, uint32_t id, const char* payload, size_t length);
+	void handleWindowUpdate(uint32_t id, const char* payload, size_t length);
+	void handleRstStream(uint32_t id, size_t length);
+	void handleGoaway(uint32_t id, const char* payload, size_t length);
+	ErrorCode applySettings(const char* payload, size_t length);
+
+	void endHeaders();
+	bool buildRequest(const Hpack::HeaderList& headers, bool endStream, std::string& text, bool& chunked) const;
+	void openStream(uint32_t id, const std::string& text, bool chunked, bool endStream);
+	void receiveBody(Stream* stream, const char* data, size_t length, bool endStream);
+	void updateWindows(Stream* stream);
+
+	void startResponse(Stream* stream);
+	void sendHeaders(Stream* stream);
+	bool canSend(const Stream* stream) const;
+	Stream* nextSender();
+	void finishStream(Stream* stream);
+	void resetStream(uint32_t id, ErrorCode code);
+	void closeStream(uint32_t id);
+
+	void connectionError(ErrorCode code, const std::string& reason);
+	void goAway(ErrorCode code);
+	void queueFrame(int type, int flags, uint32_t id, const std::string& payload);
+	static void writeFrameHeader(char* out, size_t length, int type, int flags, uint32_t id);
+	static bool stripPadding(int flags, const char*& payload, size_t& length);
+};
+
+#endif
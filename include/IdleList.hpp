@@ -0,0 +1,35 @@
+#ifndef IDLELIST_HPP
+#define IDLELIST_HPP
+
+#include <cstddef>
+
+class IdleList
+{
+public:
+	struct Node
+	{
+		Node*   prev;
+		Node*   next;
+		void*   data;
+
+		Node();
+		bool isLinked() const;
+	};
+
+	IdleList();
+	~IdleList();
+
+	void touch(Node* node);
+	void remove(Node* node);
+	Node* oldest();
+	size_t size() const;
+
+private:
+	IdleList(const IdleList&);
+	IdleList& operator=(const IdleList&);
+
+	Node    _head;
+	size_t  _size;
+};
+
+#endif
@@ -8,6 +8,26 @@
 #include <stdexcept>
 #include "Utils.hpp"
 
+struct LimitReq
+{
+	size_t rate;
+	size_t burst;
+	size_t zone;
+
+	LimitReq();
+	void parse(const std::string& value);
+	bool isEnabled() const;
+};
+
+struct LimitRate
+{
+	size_t rate;
+	size_t after;
+	bool configured;
+
+	LimitRate();
+};
+
 class LocationConfig 
 {
 private:
@@ -20,6 +40,8 @@ private:
 	std::string _uploadPath;
 	int _redirectCode;
 	std::string _redirectPath;
+	LimitReq _limitReq;
+	LimitRate _limitRate;
 
 public:
 	LocationConfig();
@@ -33,6 +55,9 @@ public:
 	void setUploadPath(const std::string& path);
 	void setCgiPath(const std::string& cgiLine);
 	void setRedirect(const std::string& redirectValue);
+	void setLimitReq(const std::string& value);
+	void setLimitRate(const std::string& value);
+	void setLimitRateAfter(const std::string& value);
 
 	const std::string& getRoot() const;
 	const std::string& getPath() const;
@@ -44,6 +69,8 @@ public:
 	const std::string& getRedirectPath() const;
 	std::string getCgiPath(const std::string& ext) const;
 	const std::string& getUploadPath() const;
+	const LimitReq& getLimitReq() const;
+	const LimitRate& getLimitRate() const;
 
 	bool isMethodAllowed(const std::string& method) const;
 	bool hasRedirection() const;
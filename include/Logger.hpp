@@ -39,6 +39,11 @@ class Logger
 		void error(const std::string& message);
 		void fatal(const std::string& message);
 
+		void setLevel(LogLevel level);
+		LogLevel getLevel() const;
+		static bool parseLevel(const std::string& name, LogLevel& level);
+		static std::string getLevelName(LogLevel level);
+
 	private:
 		Logger();
 		Logger(const Logger&);
@@ -47,7 +52,7 @@ class Logger
 		void log(LogLevel level, const std::string& message);
 		std::string getTimestamp();
 		std::string getLevelString(LogLevel level);
-		LogLevel _currentLevel;
+		int _currentLevel;
 };
 
 
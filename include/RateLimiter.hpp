@@ -0,0 +1,73 @@
+#ifndef RATELIMITER_HPP
+#define RATELIMITER_HPP
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "LocationConfig.hpp"
+
+struct PeerAddress
+{
+	uint16_t        family;
+	unsigned char   addr[16];
+
+	PeerAddress();
+	PeerAddress(const struct sockaddr* address);
+	bool operator==(const PeerAddress& other) const;
+	std::string toString() const;
+	bool hasAddress() const;
+};
+
+class RateLimiter
+{
+public:
+	RateLimiter(size_t capacity, size_t shards);
+	~RateLimiter();
+
+	bool acquireConnection(const PeerAddress& peer, size_t limit);
+	void releaseConnection(const PeerAddress& peer);
+	bool admitRequest(const PeerAddress& peer, const LimitReq& rule);
+	size_t size();
+	size_t purge();
+
+private:
+	struct Entry
+	{
+		PeerAddress     peer;
+		size_t          zone;
+		size_t          connections;
+		uint64_t        tokens;
+		uint64_t        updated;
+		uint64_t        expires;
+		bool            used;
+
+		Entry();
+	};
+
+	struct Shard
+	{
+		pthread_mutex_t     lock;
+		std::vector<Entry>  entries;
+		size_t              used;
+	};
+
+	RateLimiter(const RateLimiter&);
+	RateLimiter& operator=(const RateLimiter&);
+
+	std::vector<Shard*> _shards;
+	size_t              _minCapacity;
+	size_t              _maxCapacity;
+
+	Shard& getShard(const PeerAddress& peer);
+	Entry* lookup(Shard& shard, const PeerAddress& peer, size_t zone, bool create, uint64_t now);
+	bool rehash(Shard& shard, uint64_t now);
+	void rebuild(Shard& shard, size_t capacity, uint64_t now);
+	static size_t countLive(const Shard& shard, uint64_t now);
+	static bool isStale(const Entry& entry, uint64_t now);
+	static size_t hash(const PeerAddress& peer, size_t zone);
+};
+
+#endif
@@ -13,10 +13,56 @@
 # include "Utils.hpp"
 
 #define TIMEOUT 30
+#define KEEPALIVE_REQUESTS 1000
 #define CGI_TIMEOUT 10
+#define CGI_POLL_INTERVAL 10
+#define TIMER_RESOLUTION 10
 #define CLIENTS 1024
 #define EVENTS 1024
+#define ACCEPT_BUDGET 64
+#define OVERLOAD_REJECTS 16
+#define OVERLOAD_RETRY_AFTER 5
+#define WRITE_MEMORY_BUDGET 256*1024*1024
 #define BUFFER_SIZE 1024*1024
+#define READ_BUFFER_SIZE 16*1024
+#define WRITE_BUFFER_SIZE 64*1024
+#define WRITE_BUFFERS_CACHED 64
+#define READ_HIGH_WATERMARK 64*1024
+#define READ_LOW_WATERMARK 16*1024
+#define RATE_LIMIT_BURST_MS 100
+#define SCHEDULE_BYTE_BUDGET 256*1024
+#define SCHEDULE_REQUEST_BUDGET 16
+#define LIMIT_TABLE_SIZE 1024
+#define LIMIT_TABLE_MAX 256*1024
+#define LIMIT_TABLE_SHARDS 16
+#define DRAIN_IDLE_GRACE 1000
+#define LISTEN_DEFER_ACCEPT 1
+#define TLS_SESSION_TIMEOUT 300
+#define TLS_TICKET_ROTATION 3600
+#define H2_MAX_STREAMS 128
+#define H2_WINDOW_SIZE 1024*1024
+#define H2_FRAME_SIZE 16384
+#define H2_HEADER_TABLE_SIZE 4096
+
+struct ListenOptions
+{
+	int backlog;
+	bool ssl;
+	bool http2;
+	bool nodelay;
+	bool cork;
+	int deferAccept;
+	int fastOpen;
+	int rcvbuf;
+	int sndbuf;
+	int notsentLowat;
+	bool keepalive;
+	int keepIdle;
+	int keepInterval;
+	int keepCount;
+
+	ListenOptions();
+};
 
 class ServerConfig 
 {
@@ -25,11 +71,30 @@ private:
 	std::string _serverName;
 	std::string _root;
 	size_t _clientMaxBodySize;
+	size_t _keepaliveRequests;
+	size_t _keepaliveTimeout;
+	size_t _clientHeaderTimeout;
+	size_t _clientBodyTimeout;
+	size_t _clientBodyMinRate;
+	size_t _limitConn;
+	LimitReq _limitReq;
+	LimitRate _limitRate;
+	size_t _maxConnections;
+	size_t _maxCgiProcesses;
+	size_t _maxBodyInFlight;
 	std::string _clientBodyTmpPath;
+	std::string _sslCertificate;
+	std::string _sslCertificateKey;
 	std::map<int, std::string> _errorPages;
 	std::map<std::string, LocationConfig> _locations;
 	std::map<std::string, std::vector<uint16_t> > _host_ports;
+	std::map<std::string, ListenOptions> _listenOptions;
 	std::vector<ServerConfig> _servers;
+	size_t _workerThreads;
+	size_t _workerProcesses;
+	bool _edgeTriggered;
+	size_t _maxEgressRate;
+	std::string _adminSocket;
 	bool _isDefault;
 
 public:
@@ -41,12 +106,19 @@ public:
 	std::string getRoot() const;
 
 	std::vector<ServerConfig> getServers() const;
+	size_t getWorkerThreads() const;
+	size_t getWorkerProcesses() const;
+	bool isEdgeTriggered() const;
+	size_t getMaxEgressRate() const;
+	const std::string& getAdminSocket() const;
 
 	void setPorts(const std::vector<uint16_t>& newPorts);
 	std::vector<uint16_t> getPortsByHost(const std::string& host) const;
 	const std::map<std::string, std::vector<uint16_t> >& getHostPort() const;
 
 	void setHostPort(const std::string& hostPort);
+	void addUnixListener(const std::string& host, const ListenOptions& options);
+	const ListenOptions& getListenOptions(const std::string& host, uint16_t port) const;
 	static bool isValidHost(const std::string& host);
 
 	void setServerName(const std::string& name);
@@ -55,9 +127,49 @@ public:
 	void setClientMaxBodySize(const std::string& size);
 	size_t getClientMaxBodySize() const;
 
+	void setKeepaliveRequests(const std::string& value);
+	size_t getKeepaliveRequests() const;
+
+	void setKeepaliveTimeout(const std::string& value);
+	size_t getKeepaliveTimeout() const;
+
+	void setClientHeaderTimeout(const std::string& value);
+	size_t getClientHeaderTimeout() const;
+
+	void setClientBodyTimeout(const std::string& value);
+	size_t getClientBodyTimeout() const;
+
+	void setClientBodyMinRate(const std::string& value);
+	size_t getClientBodyMinRate() const;
+
+	void setLimitConn(const std::string& value);
+	size_t getLimitConn() const;
+
+	void setLimitReq(const std::string& value);
+	const LimitReq& getLimitReq() const;
+
+	void setLimitRate(const std::string& value);
+	void setLimitRateAfter(const std::string& value);
+	const LimitRate& getLimitRate() const;
+
+	void setMaxConnections(const std::string& value);
+	size_t getMaxConnections() const;
+
+	void setMaxCgiProcesses(const std::string& value);
+	size_t getMaxCgiProcesses() const;
+
+	void setMaxBodyInFlight(const std::string& value);
+	size_t getMaxBodyInFlight() const;
+
 	void setClientBodyTmpPath(const std::string& path);
 	std::string getClientBodyTmpPath() const;
 
+	void setSslCertificate(const std::string& path);
+	void setSslCertificateKey(const std::string& path);
+	const std::string& getSslCertificate() const;
+	const std::string& getSslCertificateKey() const;
+	bool hasSslListener() const;
+
 	void setErrorPage(const std::string& value);
 	const std::map<int, std::string>& getErrorPages() const;
 	std::string getErrorPage(int statusCode) const;
@@ -3,42 +3,91 @@
 
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <ctime>
 #include <cstring>
-#include <sys/epoll.h>
+#include <csignal>
+#include <pthread.h>
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "ServerConfig.hpp"
-#include "Client.hpp"
-#include "Epoll.hpp"
+#include "EventLoop.hpp"
+#include "AdminServer.hpp"
+
+typedef std::map<std::string, int> ListenerMap;
 
 class ServerManager
 {
 private:
-	Epoll                        _epoll;
-	bool                                _running;
+	std::string                         _configFile;
+	std::vector<std::string>            _arguments;
 	std::vector<ServerConfig>           _servers;
-	std::vector<int>                    _serverFds;
-	std::map<int, Client*>              _clients;
+	size_t                              _workerThreads;
+	size_t                              _workerProcesses;
+	size_t                              _maxEgressRate;
+	std::string                         _adminSocket;
+	AdminServer*                        _admin;
+	int                                 _workerSlot;
+	bool                                _edgeTriggered;
+	volatile bool                       _running;
+	volatile sig_atomic_t               _reloadRequested;
+	volatile sig_atomic_t               _drainRequested;
+	volatile sig_atomic_t               _upgradeRequested;
+	pid_t                               _upgradePid;
+	pid_t                               _upgradeParent;
+	std::vector<ListenerMap>            _loopListeners;
+	RateLimiter                         _limiter;
+	TokenBucket*                        _egress;
+	std::vector<EventLoop*>             _loops;
+	std::vector<pthread_t>              _threads;
+	std::vector<pid_t>                  _workers;
+	std::vector<pid_t>                  _retiring;
+	std::vector<time_t>                 _spawnTimes;
+
+	ServerManager(const ServerManager&);
+	ServerManager& operator=(const ServerManager&);
 
 public:
-	ServerManager(const std::vector<ServerConfig>& servers);
+	ServerManager(const ServerConfig& config, const std::string& configFile);
 	~ServerManager();
 
 	bool init();
 	void run();
 	void stop();
+	void requestReload();
+	void requestDrain();
+	void requestUpgrade();
+	void setArguments(char* argv[]);
 
 private:
-	int createAndBindSocket(const std::string& host, uint16_t port);
+	int createAndBindSocket(const std::string& host, uint16_t port, bool reusePort, const ListenOptions& options);
+	bool bindListeners(const std::vector<ServerConfig>& servers, const ListenerMap& current, const ListenerMap& shared, ListenerMap& listeners, bool reusePort, bool verbose);
+	bool reloadConfig(std::vector<ListenerMap>& previous);
+	std::set<int> adoptListeners(std::vector<ListenerMap>& inherited);
+	void upgradeBinary();
+	void reapUpgrade(pid_t pid, int status);
+	void notifyUpgrade();
+
+	bool startLoops();
+	void runLoops();
+	void reloadLoops();
+	void superviseWorkers();
+	pid_t spawnWorker(size_t slot);
+	pid_t reloadWorkers();
+	void runWorker();
 
-	void handleEvent(const epoll_event& event);
-	void acceptClient(int fd);
+	static void closeUnused(const std::set<int>& fds, const std::vector<ListenerMap>& keep, bool removeFiles);
+	static std::set<int> collectFds(const std::vector<ListenerMap>& listeners);
+	static std::vector<int> getListenerFds(const ListenerMap& listeners);
+	static std::string getListenerKey(int fd);
+	static void applyListenOptions(int fd, const std::string& key, const ListenOptions& options);
 
-	void checkTimeouts();
-	void cleanupClient(int fd);
+	static int getDefaultBacklog();
+	static bool checkCertificates(const std::vector<ServerConfig>& servers);
+	static void* runLoop(void* loop);
 };
 
 #endif
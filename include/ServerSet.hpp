@@ -0,0 +1,35 @@
+#ifndef SERVERSET_HPP
+#define SERVERSET_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "ServerConfig.hpp"
+#include "VhostQuota.hpp"
+#include "TlsContext.hpp"
+
+// one configuration generation, shared by every connection accepted under it
+struct ServerSet
+{
+	const std::vector<ServerConfig>     servers;
+	VhostQuota                          quota;
+	std::map<std::string, TlsContext*>  tls;
+	std::set<std::string>               http2;
+	size_t                              clients;
+
+	ServerSet(const std::vector<ServerConfig>& configs, VhostQuota::Table* usage);
+	~ServerSet();
+
+	TlsContext* getTlsContext(const std::string& listenKey) const;
+	bool hasHttp2(const std::string& listenKey) const;
+
+private:
+	ServerSet(const ServerSet&);
+	ServerSet& operator=(const ServerSet&);
+
+	void configureListeners();
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+class TimerWheel
+{
+public:
+	struct Timer
+	{
+		Timer*      prev;
+		Timer*      next;
+		uint64_t    expires;
+		void*       data;
+
+		Timer();
+		bool isPending() const;
+	};
+
+	TimerWheel(unsigned tickMs);
+	~TimerWheel();
+
+	void schedule(Timer* timer, uint64_t expires);
+	void cancel(Timer* timer);
+	void advance(uint64_t now, std::vector<Timer*>& expired);
+	int nextTimeout(uint64_t now) const;
+	size_t size() const;
+
+	static uint64_t now();
+
+private:
+	TimerWheel(const TimerWheel&);
+	TimerWheel& operator=(const TimerWheel&);
+
+	Timer       _slots[TIMER_LEVELS][TIMER_SLOTS];
+	unsigned    _tick;
+	uint64_t    _current;
+	size_t      _count;
+
+	void place(Timer* timer, uint64_t ticks);
+	void cascade(unsigned level);
+	static void link(Timer* head, Timer* timer);
+	static void unlink(Timer* timer);
+};
+
+#endif
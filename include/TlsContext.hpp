@@ -0,0 +1,43 @@
+#ifndef TLSCONTEXT_HPP
+#define TLSCONTEXT_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <openssl/ssl.h>
+#include <openssl/hmac.h>
+#include "ServerConfig.hpp"
+
+// certificates for one ssl listen address, the first server on it is the default for unknown SNI names
+class TlsContext
+{
+private:
+	SSL_CTX*                            _default;
+	std::map<std::string, SSL_CTX*>     _names;
+	std::vector<SSL_CTX*>               _contexts;
+
+	TlsContext(const TlsContext&);
+	TlsContext& operator=(const TlsContext&);
+
+	SSL_CTX* createContext(const std::string& certificate, const std::string& key, bool http2);
+	static int selectServer(SSL* ssl, int* alert, void* arg);
+	static int selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* outLength, const unsigned char* in, unsigned int inLength, void* arg);
+	static int selectTicketKey(unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, unsigned char* macKey, int encrypt);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int handleTicket(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt);
+#else
+	static int handleTicket(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt);
+#endif
+
+public:
+	TlsContext(const std::vector<const ServerConfig*>& servers, bool http2);
+	~TlsContext();
+
+	SSL* createSession(int fd) const;
+
+	static void initTicketKeys();
+	static std::string getError();
+	static bool hasKernelTls(SSL* ssl);
+};
+
+#endif
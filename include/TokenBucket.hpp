@@ -0,0 +1,30 @@
+#ifndef TOKENBUCKET_HPP
+#define TOKENBUCKET_HPP
+
+#include <cstddef>
+#include <stdint.h>
+
+class TokenBucket
+{
+private:
+	size_t      _rate;
+	uint64_t    _capacity;
+	uint64_t    _tokens;
+	uint64_t    _updated;
+
+	void refill(uint64_t now);
+
+public:
+	TokenBucket();
+	~TokenBucket();
+
+	void configure(size_t bytesPerSecond, uint64_t now);
+	bool isLimited() const;
+	size_t available(uint64_t now);
+	void consume(size_t bytes);
+	size_t take(size_t bytes, uint64_t now);
+	void refund(size_t bytes);
+	uint64_t waitTime(size_t bytes) const;
+};
+
+#endif
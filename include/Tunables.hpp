@@ -0,0 +1,29 @@
+#ifndef TUNABLES_HPP
+#define TUNABLES_HPP
+
+#include <cstddef>
+
+// limits that start from the compile-time defaults and can be changed through the admin socket
+class Tunables
+{
+public:
+	static Tunables& getInstance();
+
+	size_t getTimeout() const;
+	size_t getCgiTimeout() const;
+	size_t getClients() const;
+	void setTimeout(size_t seconds);
+	void setCgiTimeout(size_t seconds);
+	void setClients(size_t clients);
+
+private:
+	Tunables();
+	Tunables(const Tunables&);
+	Tunables& operator=(const Tunables&);
+
+	size_t _timeout;
+	size_t _cgiTimeout;
+	size_t _clients;
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <sstream>
 #include <vector>
 #include <stdlib.h>
+#include <stdint.h>
 
 namespace Utils 
 {
@@ -67,6 +68,8 @@ namespace Utils
 	std::string getExtension(const std::string& path);
 	std::string createUploadFile(const std::string& prefix, const std::string& dir);
 	bool isFileWritable(const std::string& path);
+	std::string getListenKey(const std::string& host, uint16_t port);
+	bool getSocketAddress(int fd, std::string& host, uint16_t& port);
 }
 
 
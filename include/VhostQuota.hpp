@@ -0,0 +1,60 @@
+#ifndef VHOSTQUOTA_HPP
+#define VHOSTQUOTA_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+#include "ServerConfig.hpp"
+
+class VhostQuota
+{
+public:
+	enum Resource
+	{
+		CONNECTIONS,
+		CGI,
+		BODY_BYTES
+	};
+
+	struct Usage
+	{
+		size_t      connections;
+		size_t      cgi;
+		size_t      bodyBytes;
+		size_t      rejected;
+		uint64_t    lastReport;
+
+		Usage();
+	};
+
+	// the counters of one configuration generation, shared by every loop of the process
+	struct Table
+	{
+		std::vector<Usage>  usage;
+		size_t              refs;
+
+		Table(size_t servers);
+		void retain();
+		void release();
+	};
+
+	VhostQuota(const std::vector<ServerConfig>& servers, Table* table);
+	~VhostQuota();
+
+	bool acquire(const ServerConfig* server, Resource resource, size_t amount);
+	void release(const ServerConfig* server, Resource resource, size_t amount);
+
+private:
+	VhostQuota(const VhostQuota&);
+	VhostQuota& operator=(const VhostQuota&);
+
+	const std::vector<ServerConfig>&    _servers;
+	Table*                              _table;
+
+	Usage& getUsage(const ServerConfig* server);
+	static size_t getLimit(const ServerConfig& server, Resource resource);
+	static size_t& getCounter(Usage& usage, Resource resource);
+	void reportSaturation(const ServerConfig& server, Usage& usage, Resource resource);
+};
+
+#endif
@@ -0,0 +1,324 @@
+#include "../include/AdminServer.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Tunables.hpp"
+#include "../include/Utils.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <sstream>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define ADMIN_CONNECTIONS 8
+#define ADMIN_INPUT_MAX 4096
+
+AdminServer::Connection::Connection(int connectionFd) : EventSource(EventSource::ADMIN), fd(connectionFd), closing(false), writing(false)
+{
+}
+
+AdminServer::AdminServer(const std::string& path, const std::vector<EventLoop*>& loops, pid_t controlPid)
+	: _path(path),
+	_fd(-1),
+	_inode(0),
+	_listener(EventSource::ADMIN),
+	_poller(loops[0]->getPoller()),
+	_loops(loops),
+	_controlPid(controlPid)
+{
+	struct sockaddr_un address;
+	struct stat info;
+
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("admin_socket path too long: " + path);
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+
+	// a socket left behind by a crashed instance is replaced, anything else is not touched
+	if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path.c_str());
+
+	_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (_fd < 0)
+		throw std::runtime_error("admin socket: " + std::string(strerror(errno)));
+	mode_t mask = umask(077);
+	int bound = bind(_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+	umask(mask);
+	if (bound < 0 || listen(_fd, ADMIN_CONNECTIONS) < 0 || stat(path.c_str(), &info) < 0)
+	{
+		std::string error = strerror(errno);
+		close(_fd);
+		throw std::runtime_error("Failed to bind admin socket " + path + ": " + error);
+	}
+	_inode = info.st_ino;
+
+	if (!_poller->add(_fd, EPOLLIN, &_listener))
+	{
+		close(_fd);
+		unlink(path.c_str());
+		throw std::runtime_error("Failed to add admin socket to the poller");
+	}
+	loops[0]->setAdmin(this);
+	LOG_INFO("Admin socket listening on " + path);
+}
+
+AdminServer::~AdminServer()
+{
+	struct stat info;
+
+	while (!_connections.empty())
+		closeConnection(_connections.back());
+	_poller->remove(_fd);
+	close(_fd);
+	// after a binary upgrade the path belongs to the new process
+	if (stat(_path.c_str(), &info) == 0 && info.st_ino == _inode)
+		unlink(_path.c_str());
+}
+
+void AdminServer::handleEvent(EventSource* source, uint32_t events)
+{
+	if (source == &_listener)
+		return acceptConnection();
+
+	Connection* connection = static_cast<Connection*>(source);
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		readCommands(connection);
+	else if (events & EPOLLOUT)
+		flush(connection);
+}
+
+void AdminServer::acceptConnection()
+{
+	while (true)
+	{
+		int fd = accept4(_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (_connections.size() >= ADMIN_CONNECTIONS)
+		{
+			close(fd);
+			LOG_WARN("Too many admin connections, closing new one");
+			continue;
+		}
+
+		Connection* connection = new Connection(fd);
+		if (!_poller->add(fd, EPOLLIN, connection))
+		{
+			close(fd);
+			delete connection;
+			continue;
+		}
+		_connections.push_back(connection);
+	}
+}
+
+void AdminServer::readCommands(Connection* connection)
+{
+	char buffer[ADMIN_INPUT_MAX];
+
+	while (!connection->closing)
+	{
+		ssize_t bytesRead = recv(connection->fd, buffer, sizeof(buffer), 0);
+		if (bytesRead > 0)
+			connection->input.append(buffer, bytesRead);
+		else if (bytesRead == 0)
+		{
+			// commands piped in without a trailing newline still run
+			if (!connection->input.empty())
+				connection->input += '\n';
+			connection->closing = true;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		else
+			return closeConnection(connection);
+	}
+
+	size_t end;
+	while ((end = connection->input.find('\n')) != std::string::npos)
+	{
+		std::string line = connection->input.substr(0, end);
+		connection->input.erase(0, end + 1);
+		bool quit = false;
+		connection->output += execute(line, quit);
+		if (quit)
+		{
+			connection->closing = true;
+			connection->input.clear();
+		}
+	}
+	if (connection->input.size() > ADMIN_INPUT_MAX)
+	{
+		connection->output += "error: command too long\n";
+		connection->closing = true;
+	}
+	flush(connection);
+}
+
+void AdminServer::flush(Connection* connection)
+{
+	while (!connection->output.empty())
+	{
+		ssize_t bytesSent = send(connection->fd, connection->output.data(), connection->output.size(), MSG_NOSIGNAL);
+		if (bytesSent > 0)
+			connection->output.erase(0, bytesSent);
+		else if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			uint32_t events = connection->closing ? static_cast<uint32_t>(EPOLLOUT) : static_cast<uint32_t>(EPOLLIN | EPOLLOUT);
+			if (!_poller->modify(connection->fd, events, connection))
+				return closeConnection(connection);
+			connection->writing = true;
+			return;
+		}
+		else
+			return closeConnection(connection);
+	}
+	if (connection->closing)
+		return closeConnection(connection);
+	if (connection->writing && !_poller->modify(connection->fd, EPOLLIN, connection))
+		return closeConnection(connection);
+	connection->writing = false;
+}
+
+void AdminServer::closeConnection(Connection* connection)
+{
+	for (size_t i = 0; i < _connections.size(); ++i)
+	{
+		if (_connections[i] == connection)
+		{
+			_connections.erase(_connections.begin() + i);
+			break;
+		}
+	}
+	_poller->remove(connection->fd);
+	_poller->invalidate(connection);
+	close(connection->fd);
+	delete connection;
+}
+
+std::string AdminServer::execute(const std::string& line, bool& closing)
+{
+	std::istringstream stream(line);
+	std::string command, name, value, extra;
+
+	stream >> command >> name >> value >> extra;
+	if (command.empty())
+		return "";
+	if (!extra.empty())
+		return "error: too many arguments\n";
+
+	if (command == "help")
+		return help();
+	if (command == "get")
+		return getTunables();
+	if (command == "set")
+		return setTunable(name, value);
+	if (command == "log")
+		return setLogLevel(name);
+	if (command == "dump")
+		return controlLoops(EventLoop::CONTROL_DUMP);
+	if (command == "drop-caches")
+	{
+		LOG_INFO("Admin: dropping caches");
+		return controlLoops(EventLoop::CONTROL_TRIM);
+	}
+	if (command == "reload")
+		return signalServer(SIGHUP, "reload");
+	if (command == "shutdown")
+		return signalServer(SIGQUIT, "graceful shutdown");
+	if (command == "quit")
+	{
+		closing = true;
+		return "";
+	}
+	return "error: unknown command '" + command + "', try 'help'\n";
+}
+
+std::string AdminServer::help() const
+{
+	return "get                        show tunables and log level\n"
+		"set timeout <seconds>      idle timeout for requests and responses\n"
+		"set cgi_timeout <seconds>  time a CGI script may stay silent\n"
+		"set max_clients <count>    connections per event loop\n"
+		"log <level>                debug, info, warning, error or fatal\n"
+		"dump                       per-loop counters and open connections\n"
+		"drop-caches                free pooled buffers, clients and stale limiter entries\n"
+		"reload                     reload the configuration file\n"
+		"shutdown                   stop accepting and exit once connections finish\n"
+		"quit                       close this admin connection\n";
+}
+
+std::string AdminServer::getTunables() const
+{
+	Tunables& tunables = Tunables::getInstance();
+
+	return "pid " + Utils::toString(getpid()) + "\n"
+		"loops " + Utils::toString(_loops.size()) + "\n"
+		"timeout " + Utils::toString(tunables.getTimeout()) + "\n"
+		"cgi_timeout " + Utils::toString(tunables.getCgiTimeout()) + "\n"
+		"max_clients " + Utils::toString(tunables.getClients()) + "\n"
+		"log " + Logger::getLevelName(Logger::getInstance().getLevel()) + "\n";
+}
+
+std::string AdminServer::setTunable(const std::string& name, const std::string& value)
+{
+	size_t number;
+
+	try
+	{
+		number = Utils::stringToSizeT(value);
+	}
+	catch (const std::exception& e)
+	{
+		return "error: invalid value '" + value + "'\n";
+	}
+
+	Tunables& tunables = Tunables::getInstance();
+	if ((name == "timeout" || name == "cgi_timeout") && (number < 1 || number > 3600))
+		return "error: " + name + " out of range (1-3600)\n";
+	if (name == "max_clients" && (number < 1 || number > 65536))
+		return "error: max_clients out of range (1-65536)\n";
+
+	if (name == "timeout")
+		tunables.setTimeout(number);
+	else if (name == "cgi_timeout")
+		tunables.setCgiTimeout(number);
+	else if (name == "max_clients")
+		tunables.setClients(number);
+	else
+		return "error: unknown tunable '" + name + "'\n";
+	LOG_INFO("Admin: " + name + " set to " + value);
+	return "ok\n";
+}
+
+std::string AdminServer::setLogLevel(const std::string& name)
+{
+	Logger::LogLevel level;
+
+	if (!Logger::parseLevel(name, level))
+		return "error: unknown log level '" + name + "'\n";
+	Logger::getInstance().setLevel(level);
+	LOG_INFO("Admin: log level set to " + name);
+	return "ok\n";
+}
+
+std::string AdminServer::controlLoops(EventLoop::Control command)
+{
+	std::string result;
+
+	// this runs on the first loop, every other loop answers on its own thread
+	for (size_t i = 0; i < _loops.size(); ++i)
+		result += i == 0 ? _loops[i]->runControl(command) : _loops[i]->control(command);
+	return result;
+}
+
+std::string AdminServer::signalServer(int signum, const std::string& action)
+{
+	LOG_INFO("Admin: " + action + " requested");
+	if (kill(_controlPid, signum) < 0)
+		return "error: " + std::string(strerror(errno)) + "\n";
+	return "ok\n";
+}
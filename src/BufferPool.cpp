@@ -0,0 +1,64 @@
+#include "../include/BufferPool.hpp"
+
+BufferPool::BufferPool(size_t bufferSize, size_t maxFree) : _bufferSize(bufferSize), _maxFree(maxFree), _inUse(0)
+{
+	_free.reserve(maxFree);
+}
+
+BufferPool::~BufferPool()
+{
+	for (size_t i = 0; i < _free.size(); ++i)
+		delete[] _free[i];
+	_free.clear();
+}
+
+char* BufferPool::acquire()
+{
+	char* buffer;
+
+	if (_free.empty())
+		buffer = new char[_bufferSize];
+	else
+	{
+		buffer = _free.back();
+		_free.pop_back();
+	}
+	++_inUse;
+	return buffer;
+}
+
+void BufferPool::release(char* buffer)
+{
+	if (!buffer)
+		return;
+	--_inUse;
+	if (_free.size() >= _maxFree)
+		delete[] buffer;
+	else
+		_free.push_back(buffer);
+}
+
+size_t BufferPool::getBufferSize() const
+{
+	return _bufferSize;
+}
+
+size_t BufferPool::getBytesInUse() const
+{
+	return _inUse * _bufferSize;
+}
+
+size_t BufferPool::getBytesCached() const
+{
+	return _free.size() * _bufferSize;
+}
+
+size_t BufferPool::trim()
+{
+	size_t released = getBytesCached();
+
+	for (size_t i = 0; i < _free.size(); ++i)
+		delete[] _free[i];
+	_free.clear();
+	return released;
+}
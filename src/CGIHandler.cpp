@@ -3,6 +3,7 @@
 #include <cstring>
 #include <sys/stat.h>
 #include <wait.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <cstring>
@@ -37,11 +38,12 @@ void CGIHandler::init(HTTPRequest* request)
 
 	_outputFile = Utils::createTempFile("cgi_output_", request->getServer().getClientBodyTmpPath());
 
-	_ouFd = open(_outputFile.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+	// other loops fork CGIs too, only dup2 may hand these files to a child
+	_ouFd = open(_outputFile.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0600);
 	if (_ouFd == -1)
 		throw std::runtime_error("Failed to create output file: " + _outputFile + " error: " + std::string(strerror(errno)));
 
-	_inFd = open(request->getBodyfile().c_str(), O_RDONLY);
+	_inFd = open(request->getBodyfile().c_str(), O_RDONLY | O_CLOEXEC);
 	if (_inFd == -1)
 		throw std::runtime_error("Failed to open request body file: " + std::string(strerror(errno)));
 
@@ -177,16 +179,6 @@ void CGIHandler::killProcess()
 }
 
 
-bool CGIHandler::hasTimedOut()
-{
-	if (_pid <= 0)
-		return false;
-
-	time_t now = time(NULL);
-	return (now - _startTime) > CGI_TIMEOUT;
-}
-
-
 void CGIHandler::start()
 {
 	buildArgv();
@@ -207,24 +199,25 @@ void CGIHandler::start()
 		{
 			close(_inFd);
 			close(_ouFd);
-			exit(EXIT_FAILURE);
+			_exit(EXIT_FAILURE);
 		}
 		close(_inFd);
 		if (dup2(_ouFd, STDOUT_FILENO) == -1) 
 		{
 			close(_ouFd);
-			exit(EXIT_FAILURE);
+			_exit(EXIT_FAILURE);
 		}
 
 		if (dup2(_ouFd, STDERR_FILENO) == -1) 
 		{
 			close(_ouFd);
-			exit(EXIT_FAILURE);
+			_exit(EXIT_FAILURE);
 		}
 		close(_ouFd);
 
+		signal(SIGPIPE, SIG_DFL);
 		execve(_execPath.c_str(), _argv, _envp);
-		exit(EXIT_FAILURE);
+		_exit(EXIT_FAILURE);
 	}
 }
 
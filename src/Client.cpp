@@ -1,66 +1,484 @@
 #include "../include/Client.hpp"
 #include "../include/HTTPRequest.hpp"
+#include "../include/Logger.hpp"
 #include <cwchar>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <wait.h>
 #include <iostream>
+#include <algorithm>
+#include <openssl/err.h>
 
-Client::Client(int fd, std::vector<ServerConfig>& servers) : _fd(fd), _request(servers), _response(&_request), _lastActivity(time(NULL))
+Client::Client(bool edgeTriggered, BufferPool& readBuffers, BufferPool& writeBuffers)
+	: EventSource(EventSource::CLIENT),
+	_fd(-1),
+	_ssl(NULL),
+	_http2(NULL),
+	_http2Enabled(false),
+	_limiter(NULL),
+	_serverSet(NULL),
+	_response(&_request),
+	_readBuffers(&readBuffers),
+	_writeBuffers(&writeBuffers),
+	_writeBuffer(NULL),
+	_writeOffset(0),
+	_writeLength(0),
+	_egress(NULL),
+	_egressReserved(0),
+	_rateAfter(0),
+	_responseBytes(0),
+	_throttleUntil(0),
+	_lastActivity(TimerWheel::now()),
+	_requestStart(_lastActivity),
+	_bodyStart(0),
+	_bodyBytes(0),
+	_budgetBytes(SCHEDULE_BYTE_BUDGET),
+	_budgetRequests(SCHEDULE_REQUEST_BUDGET),
+	_requests(0),
+	_keepaliveTimeout(TIMEOUT),
+	_edgeTriggered(edgeTriggered),
+	_readable(false),
+	_readPaused(false),
+	_writable(true),
+	_responseStarted(false),
+	_cork(false),
+	_handshaking(false),
+	_tlsClean(false),
+	_tlsBlocked(0),
+	_tlsRetry(0),
+	_interest(EPOLLIN)
 {
+	_timer.data = this;
+	_idleNode.data = this;
+	_runNode.data = this;
 }
 
 Client::~Client()
 {
+	delete _http2;
+	_writeBuffers->release(_writeBuffer);
+	if (_ssl)
+		SSL_free(_ssl);
 	if (_fd >= 0)
 		close(_fd);
 }
 
+void Client::reinit(int fd, const PeerAddress& peer, ServerSet* serverSet)
+{
+	_fd = fd;
+	_peer = peer;
+	setServerSet(serverSet);
+	_request.setClientfd(fd);
+	_request.setPeer(peer);
+	_writeOffset = 0;
+	_writeLength = 0;
+	_throttleUntil = 0;
+	_readable = false;
+	_readPaused = false;
+	_writable = true;
+	_responseStarted = false;
+	_interest = EPOLLIN;
+	_requests = 0;
+	_keepaliveTimeout = TIMEOUT;
+	updateActivity();
+	_requestStart = _lastActivity;
+	_bodyStart = 0;
+	_bodyBytes = 0;
+}
+
+void Client::release()
+{
+	if (_http2)
+		_http2->closeStreams();
+	delete _http2;
+	_http2 = NULL;
+	_http2Enabled = false;
+	_request.clear();
+	_response.clear();
+	if (_readBuffer.capacity() > READ_HIGH_WATERMARK + READ_BUFFER_SIZE)
+		std::string().swap(_readBuffer);
+	else
+		_readBuffer.clear();
+	releaseWriteBuffer();
+	if (_ssl)
+	{
+		// close_notify is best effort, a fatal error forbids it
+		ERR_clear_error();
+		if (_tlsClean && !_handshaking)
+			SSL_shutdown(_ssl);
+		SSL_free(_ssl);
+		ERR_clear_error();
+		_ssl = NULL;
+	}
+	_handshaking = false;
+	_tlsBlocked = 0;
+	_tlsRetry = 0;
+	if (_fd >= 0)
+		close(_fd);
+	_fd = -1;
+}
+
+void Client::setHttp2(bool enabled)
+{
+	_http2Enabled = enabled;
+}
+
+// prior knowledge: the connection opens with the HTTP/2 preface instead of a request line
+bool Client::startHttp2()
+{
+	if (_http2)
+		return true;
+	if (!_http2Enabled || _requests > 0 || _request.getState() != HTTPRequest::INIT || !Http2Connection::matchesPreface(_readBuffer))
+		return false;
+	if (Http2Connection::hasPreface(_readBuffer))
+	{
+		_http2 = new Http2Connection(_fd, _peer, _serverSet, _limiter);
+		_sendBucket.configure(0, TimerWheel::now());
+	}
+	return true;
+}
+
+// h2c upgrade is only taken for requests without a body, their response becomes stream 1
+bool Client::upgradeHttp2()
+{
+	if (!_http2Enabled || _ssl || _request.getState() != HTTPRequest::FINISH || _request.getHeader("upgrade").empty())
+		return false;
+	if (_request.getContentLength() > 0 || !_request.getHeader("transfer-encoding").empty())
+		return false;
+
+	Http2Connection* http2 = new Http2Connection(_fd, _peer, _serverSet, _limiter);
+	if (!http2->upgrade(&_request, &_response))
+	{
+		delete http2;
+		return false;
+	}
+	_http2 = http2;
+	_sendBucket.configure(0, TimerWheel::now());
+	_http2->consume(_readBuffer);
+	updateReadPause();
+	return true;
+}
+
+Http2Connection* Client::getHttp2() const
+{
+	return _http2;
+}
+
+bool Client::hasPendingOutput() const
+{
+	return _writeOffset < _writeLength || (_http2 && _http2->hasPendingOutput());
+}
+
+void Client::startTls(SSL* ssl)
+{
+	_ssl = ssl;
+	_handshaking = true;
+	_tlsClean = true;
+	_tlsBlocked = 0;
+	_tlsRetry = 0;
+}
+
+bool Client::handshake()
+{
+	ERR_clear_error();
+	int result = SSL_do_handshake(_ssl);
+	if (result == 1)
+	{
+		_handshaking = false;
+		_tlsBlocked = 0;
+		_readable = true;
+		LOG_DEBUG("TLS handshake done on fd " + Utils::toString(_fd) + " (" + SSL_get_version(_ssl) + (SSL_session_reused(_ssl) ? ", resumed" : "") + (hasKernelTls() ? ", ktls" : "") + ")");
+		return true;
+	}
+
+	int error = SSL_get_error(_ssl, result);
+	if (error == SSL_ERROR_WANT_READ)
+		_tlsBlocked = EPOLLIN;
+	else if (error == SSL_ERROR_WANT_WRITE)
+		_tlsBlocked = EPOLLOUT;
+	else
+	{
+		_tlsClean = false;
+		throw std::runtime_error("TLS handshake failed on fd " + Utils::toString(_fd) + ": " + TlsContext::getError());
+	}
+	return false;
+}
+
+bool Client::isTls() const
+{
+	return _ssl != NULL;
+}
+
+bool Client::isHandshaking() const
+{
+	return _handshaking;
+}
+
+bool Client::hasKernelTls() const
+{
+	return _ssl && TlsContext::hasKernelTls(_ssl);
+}
+
+uint32_t Client::getTlsBlocked() const
+{
+	return _tlsBlocked;
+}
+
+void Client::resumeTls()
+{
+	_tlsBlocked = 0;
+	_readable = true;
+	_writable = true;
+}
+
+ssize_t Client::receive(char* buffer, size_t size)
+{
+	if (!_ssl)
+		return recv(_fd, buffer, size, 0);
+	ERR_clear_error();
+	return checkTls(SSL_read(_ssl, buffer, size), EPOLLIN);
+}
+
+ssize_t Client::transmit(const char* data, size_t length, int flags)
+{
+	if (!_ssl)
+		return send(_fd, data, length, flags);
+	// a retried SSL_write must not shrink, even if the rate limiter now allows less
+	if (length < _tlsRetry)
+		length = _tlsRetry;
+	ERR_clear_error();
+	ssize_t result = checkTls(SSL_write(_ssl, data, length), EPOLLOUT);
+	_tlsRetry = result < 0 && errno == EAGAIN ? length : 0;
+	return result;
+}
+
+// maps an SSL_read/SSL_write result onto the recv/send conventions used by the callers
+ssize_t Client::checkTls(int result, uint32_t direction)
+{
+	if (result > 0)
+		return result;
+
+	int error = SSL_get_error(_ssl, result);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+	{
+		uint32_t wanted = error == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+		_tlsBlocked = wanted == direction ? 0 : wanted;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 && errno == 0))
+		return 0;
+	_tlsClean = false;
+	LOG_DEBUG("TLS error on fd " + Utils::toString(_fd) + ": " + TlsContext::getError());
+	errno = EPROTO;
+	return -1;
+}
+
 void Client::reset()
 {
+	if (_request.hasUnreadBody())
+		_readBuffer.clear();
 	_request.clear();
+	_request.setClientfd(_fd);
 	_response.clear();
-	_readBuffer.clear();
+	if (_budgetRequests > 0)
+		--_budgetRequests;
+	releaseWriteBuffer();
+	_responseStarted = false;
+	_throttleUntil = 0;
+	updateReadPause();
 	updateActivity();
+	_requestStart = _lastActivity;
+	_bodyStart = 0;
+	_bodyBytes = 0;
 }
 
 void Client::readRequest()
 {
-	char buffer[BUFFER_SIZE];
-	std::memset(buffer, 0, sizeof(buffer));
+	char* buffer = _readBuffers->acquire();
+	size_t size = _readBuffers->getBufferSize();
 
-	ssize_t bytesRead = recv(_fd, buffer, sizeof(buffer) - 1, 0);
+	try
+	{
+		while ((_http2 || !_request.isComplete()) && !_readPaused && hasBudget())
+		{
+			ssize_t bytesRead = receive(buffer, size);
 
-	if (bytesRead > 0) 
+			if (bytesRead > 0)
+			{
+				chargeBudget(bytesRead);
+				if (_request.getState() == HTTPRequest::INIT)
+					_requestStart = TimerWheel::now();
+				else if (isReceivingBody())
+					_bodyBytes += bytesRead;
+				_readBuffer.append(buffer, bytesRead);
+				if (!startHttp2())
+					_request.parseRequest(_readBuffer);
+				else if (_http2)
+					_http2->consume(_readBuffer);
+				updateReadPause();
+				if (!_bodyStart && isReceivingBody())
+					_bodyStart = TimerWheel::now();
+				// decrypted bytes left in the TLS record never show up as socket readiness
+				if (!_edgeTriggered && !(_ssl && SSL_pending(_ssl) > 0))
+				{
+					_readable = false;
+					break;
+				}
+			}
+			else if (bytesRead == 0)
+				throw std::runtime_error("Client disconnected");
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				_readable = false;
+				break;
+			}
+			else
+				throw std::runtime_error("recv() failed unexpectedly");
+		}
+	}
+	catch (...)
 	{
-		buffer[bytesRead] = '\0';
-		_readBuffer.append(buffer, bytesRead);
-		_request.parseRequest(_readBuffer);
+		_readBuffers->release(buffer);
+		throw;
 	}
-	else if (bytesRead == 0) 
-		throw std::runtime_error("Client disconnected");
-	else
-		throw std::runtime_error("recv() failed unexpectedly");
+	_readBuffers->release(buffer);
 }
 
 void Client::sendResponse()
 {
+	while (true)
+	{
+		if (_writeOffset == _writeLength)
+		{
+			if (!_writeBuffer)
+				_writeBuffer = _writeBuffers->acquire();
+			size_t size = _writeBuffers->getBufferSize();
+			ssize_t bytesToSend = _http2 ? _http2->getOutputChunk(_writeBuffer, size) : _response.getResponseChunk(_writeBuffer, size);
+			if (bytesToSend < 0)
+				throw std::runtime_error("Error generating response");
+			if (bytesToSend == 0)
+				return releaseWriteBuffer();
+			_writeOffset = 0;
+			_writeLength = bytesToSend;
+		}
 
-	char buffer[BUFFER_SIZE];
-	std::memset(buffer, 0, sizeof(buffer));
-	ssize_t bytesToSend = _response.getResponseChunk(buffer);
+		if (!hasBudget())
+			break;
+		size_t length = getSendAllowance(_writeLength - _writeOffset);
+		if (length == 0)
+			break;
 
-	if (bytesToSend > 0) 
-	{
-		ssize_t bytesSent = send(_fd, buffer, bytesToSend, 0);
-		if (bytesSent <= 0)
+		// with cork only full segments leave until the last chunk, throttled sends must not wait for the next one
+		int flags = MSG_NOSIGNAL;
+		bool throttled = _sendBucket.isLimited() || (_egress && _egress->isLimited());
+		if (_cork && !throttled && _writeOffset + length == _writeLength && (_http2 ? _http2->hasPendingOutput() : _response.hasPendingData()))
+			flags |= MSG_MORE;
+		ssize_t bytesSent = transmit(_writeBuffer + _writeOffset, length, flags);
+		// egress bytes are reserved before the send, whatever did not leave goes back to the other loops
+		if (_egressReserved > 0)
+			_egress->refund(_egressReserved - (bytesSent > 0 ? bytesSent : 0));
+		_egressReserved = 0;
+		if (bytesSent > 0)
+		{
+			_writeOffset += bytesSent;
+			_responseBytes += bytesSent;
+			chargeBudget(bytesSent);
+			if (_sendBucket.isLimited() && _responseBytes > _rateAfter)
+				_sendBucket.consume(bytesSent);
+			if (!_http2 && _writeOffset == _writeLength && !_response.hasPendingData())
+			{
+				_response.finish();
+				break;
+			}
+		}
+		else if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			_writable = false;
+			break;
+		}
+		else
 			throw std::runtime_error("send() failed");
 	}
-	else if (bytesToSend == 0) 
-		return;
-	else
-		throw std::runtime_error("Error generating response");
+	if (_writeOffset == _writeLength)
+		releaseWriteBuffer();
+	// queued control frames count against the read pause, a peer that never reads stops being read
+	if (_http2)
+		updateReadPause();
+}
+
+size_t Client::getSendAllowance(size_t length)
+{
+	bool connectionLimited = _sendBucket.isLimited() && _responseBytes >= _rateAfter;
+	bool egressLimited = _egress && _egress->isLimited();
+
+	if (!connectionLimited && !egressLimited)
+		return length;
+
+	uint64_t now = TimerWheel::now();
+	uint64_t wait = 0;
+	if (connectionLimited)
+	{
+		length = std::min(length, _sendBucket.available(now));
+		wait = _sendBucket.waitTime(_writeLength - _writeOffset);
+	}
+	if (egressLimited)
+	{
+		length = _egress->take(length, now);
+		_egressReserved = length;
+		wait = std::max(wait, _egress->waitTime(_writeLength - _writeOffset));
+	}
+	// parked connections sleep on the timer wheel instead of polling for EPOLLOUT
+	if (length == 0)
+		_throttleUntil = now + std::max(wait, static_cast<uint64_t>(1));
+	return length;
+}
+
+void Client::releaseWriteBuffer()
+{
+	_writeBuffers->release(_writeBuffer);
+	_writeBuffer = NULL;
+	_writeOffset = 0;
+	_writeLength = 0;
+}
+
+void Client::startResponse()
+{
+	const ServerConfig& server = _request.getServer();
+
+	_responseStarted = true;
+	_keepaliveTimeout = server.getKeepaliveTimeout();
+	const LimitRate& limitRate = _request.getLocation().getLimitRate().configured ? _request.getLocation().getLimitRate() : server.getLimitRate();
+	_sendBucket.configure(limitRate.rate, TimerWheel::now());
+	_rateAfter = limitRate.after;
+	_responseBytes = 0;
+	if (++_requests >= server.getKeepaliveRequests() || _keepaliveTimeout == 0)
+		_response.disableKeepAlive();
+	// an unread request body would be parsed as the next request
+	if (_request.getState() == HTTPRequest::ERROR && (!_request.getHeader("content-length").empty() || !_request.getHeader("transfer-encoding").empty()))
+		_response.disableKeepAlive();
+	_response.buildResponse();
+}
+
+bool Client::hasStartedResponse() const
+{
+	return _responseStarted;
+}
+
+bool Client::hasBufferedInput() const
+{
+	return !_readBuffer.empty();
+}
+
+void Client::parseBufferedInput()
+{
+	_request.parseRequest(_readBuffer);
+	updateReadPause();
+	if (!_bodyStart && isReceivingBody())
+		_bodyStart = TimerWheel::now();
 }
 
 int Client::getFd() const
@@ -68,14 +486,121 @@ int Client::getFd() const
 	return _fd;
 }
 
-time_t Client::getLastActivity() const
+const PeerAddress& Client::getPeer() const
+{
+	return _peer;
+}
+
+ServerSet* Client::getServerSet() const
+{
+	return _serverSet;
+}
+
+void Client::setServerSet(ServerSet* serverSet)
+{
+	_serverSet = serverSet;
+	if (_http2)
+		_http2->setServerSet(serverSet);
+	_request.setServers(serverSet->servers);
+	_request.setQuota(&serverSet->quota);
+}
+
+uint64_t Client::getLastActivity() const
 {
 	return _lastActivity;
 }
 
+TimerWheel::Timer* Client::getTimer()
+{
+	return &_timer;
+}
+
+IdleList::Node* Client::getIdleNode()
+{
+	return &_idleNode;
+}
+
+IdleList::Node* Client::getRunNode()
+{
+	return &_runNode;
+}
+
+void Client::refillBudget()
+{
+	_budgetBytes = SCHEDULE_BYTE_BUDGET;
+	_budgetRequests = SCHEDULE_REQUEST_BUDGET;
+}
+
+bool Client::hasBudget() const
+{
+	return _budgetBytes > 0 && _budgetRequests > 0;
+}
+
+void Client::chargeBudget(size_t bytes)
+{
+	_budgetBytes = bytes < _budgetBytes ? _budgetBytes - bytes : 0;
+}
+
+bool Client::isKeepAliveIdle() const
+{
+	if (_http2)
+		return _http2->isIdle();
+	return _requests > 0 && !_responseStarted && _request.getState() == HTTPRequest::INIT && _readBuffer.empty();
+}
+
+bool Client::isReceivingBody() const
+{
+	int state = _request.getState();
+	return state == HTTPRequest::CGI || state == HTTPRequest::CHUNKED || state == HTTPRequest::MULTIPART || state == HTTPRequest::DISCARD;
+}
+
+uint64_t Client::getRequestDeadline() const
+{
+	const ServerConfig& server = _request.getServer();
+
+	if (!isReceivingBody())
+		return _requestStart + server.getClientHeaderTimeout() * 1000;
+
+	uint64_t timeout = server.getClientBodyTimeout() * 1000;
+	uint64_t deadline = _lastActivity + timeout;
+	size_t minRate = server.getClientBodyMinRate();
+	if (minRate > 0)
+	{
+		// after one timeout of grace the body must keep up with the minimum rate
+		uint64_t paced = (_bodyStart ? _bodyStart : _requestStart) + timeout + _bodyBytes * 1000 / minRate;
+		if (paced < deadline)
+			deadline = paced;
+	}
+	return deadline;
+}
+
+void Client::timeoutRequest()
+{
+	_request.setStatusCode(408);
+	_request.setState(HTTPRequest::ERROR);
+	_response.disableKeepAlive();
+	_readBuffer.clear();
+	updateActivity();
+}
+
+void Client::abortCgi()
+{
+	if (_http2)
+		_http2->abortCgi();
+	else
+		_response.abortCgi();
+}
+
+size_t Client::getKeepaliveTimeout() const
+{
+	if (_http2)
+		return _http2->getKeepaliveTimeout();
+	return _keepaliveTimeout;
+}
+
 void Client::updateActivity()
 {
-	_lastActivity = time(NULL);
+	_lastActivity = TimerWheel::now();
 }
 
 HTTPRequest* Client::getRequest()
@@ -92,3 +617,80 @@ bool Client::shouldKeepAlive() const
 {
 	return _response.shouldKeepAlive();
 }
+
+bool Client::isReadable() const
+{
+	return _readable;
+}
+
+bool Client::isReadPaused() const
+{
+	return _readPaused;
+}
+
+void Client::updateReadPause()
+{
+	size_t buffered = _readBuffer.size() + (_http2 ? _http2->getQueuedBytes() : 0);
+
+	if (buffered >= READ_HIGH_WATERMARK)
+		_readPaused = true;
+	else if (buffered <= READ_LOW_WATERMARK)
+		_readPaused = false;
+}
+
+bool Client::isWritable() const
+{
+	return _writable;
+}
+
+void Client::setReadable(bool readable)
+{
+	_readable = readable;
+}
+
+void Client::setWritable(bool writable)
+{
+	_writable = writable;
+}
+
+bool Client::isThrottled() const
+{
+	return _throttleUntil != 0;
+}
+
+uint64_t Client::getThrottleUntil() const
+{
+	return _throttleUntil;
+}
+
+void Client::resumeSending()
+{
+	_throttleUntil = 0;
+	updateActivity();
+}
+
+void Client::setEgressBucket(TokenBucket* egress)
+{
+	_egress = egress;
+}
+
+void Client::setRateLimiter(RateLimiter* limiter)
+{
+	_limiter = limiter;
+	_request.setRateLimiter(limiter);
+}
+
+void Client::setCork(bool cork)
+{
+	_cork = cork;
+}
+
+uint32_t Client::getInterest() const
+{
+	return _interest;
+}
+
+void Client::setInterest(uint32_t events)
+{
+	_interest = events;
+}
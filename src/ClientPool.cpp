@@ -0,0 +1,75 @@
+#include "../include/ClientPool.hpp"
+#include <algorithm>
+
+ClientPool::ClientPool(size_t capacity, bool edgeTriggered, BufferPool& readBuffers, BufferPool& writeBuffers)
+	: _edgeTriggered(edgeTriggered),
+	_readBuffers(readBuffers),
+	_writeBuffers(writeBuffers),
+	_capacity(capacity)
+{
+	_clients.reserve(capacity);
+	_free.reserve(capacity);
+}
+
+ClientPool::~ClientPool()
+{
+	for (size_t i = 0; i < _clients.size(); ++i)
+		delete _clients[i];
+	_clients.clear();
+	_free.clear();
+}
+
+Client* ClientPool::acquire(int fd, const PeerAddress& peer, ServerSet* serverSet)
+{
+	Client* client;
+
+	if (inUse() >= _capacity)
+		return NULL;
+	if (!_free.empty())
+	{
+		client = _free.back();
+		_free.pop_back();
+	}
+	else
+	{
+		client = new Client(_edgeTriggered, _readBuffers, _writeBuffers);
+		_clients.push_back(client);
+	}
+
+	client->reinit(fd, peer, serverSet);
+	return client;
+}
+
+void ClientPool::release(Client* client)
+{
+	client->release();
+	_free.push_back(client);
+}
+
+size_t ClientPool::inUse() const
+{
+	return _clients.size() - _free.size();
+}
+
+size_t ClientPool::capacity() const
+{
+	return _capacity;
+}
+
+void ClientPool::setCapacity(size_t capacity)
+{
+	_capacity = capacity;
+}
+
+size_t ClientPool::trim()
+{
+	size_t released = _free.size();
+
+	for (size_t i = 0; i < _free.size(); ++i)
+	{
+		_clients.erase(std::find(_clients.begin(), _clients.end(), _free[i]));
+		delete _free[i];
+	}
+	_free.clear();
+	return released;
+}
@@ -11,7 +11,7 @@
 #include <iostream>
 #include <unistd.h>
 
-ConfigParser::ConfigParser(const std::string& configFilePath) : _configFile(configFilePath) 
+ConfigParser::ConfigParser(const std::string& configFilePath) : _configFile(configFilePath), _workerThreads(1), _workerProcesses(1), _edgeTriggered(false), _maxEgressRate(0)
 {
 }
 
@@ -33,6 +33,31 @@ std::vector<ServerConfig> ConfigParser::getServers() const
 	return _servers;
 }
 
+size_t ConfigParser::getWorkerThreads() const
+{
+	return _workerThreads;
+}
+
+size_t ConfigParser::getWorkerProcesses() const
+{
+	return _workerProcesses;
+}
+
+bool ConfigParser::isEdgeTriggered() const
+{
+	return _edgeTriggered;
+}
+
+size_t ConfigParser::getMaxEgressRate() const
+{
+	return _maxEgressRate;
+}
+
+const std::string& ConfigParser::getAdminSocket() const
+{
+	return _adminSocket;
+}
+
 void ConfigParser::validateBraces(const std::string& path) 
 {
 	std::ifstream file(path.c_str());
@@ -88,13 +113,16 @@ void ConfigParser::validateServerConflicts() const
 		const std::map<std::string, std::vector<uint16_t> >& hostPorts = _servers[i].getHostPort();
 		const std::string& serverName = _servers[i].getServerName();
 
+		if (_servers[i].hasSslListener() && (_servers[i].getSslCertificate().empty() || _servers[i].getSslCertificateKey().empty()))
+			throw std::runtime_error("server \"" + serverName + "\" listens with ssl but has no ssl_certificate and ssl_certificate_key");
+
 		for (std::map<std::string, std::vector<uint16_t> >::const_iterator hostIt = hostPorts.begin(); hostIt != hostPorts.end(); ++hostIt)
 		{
 			const std::string& host = hostIt->first;
 			const std::vector<uint16_t>& ports = hostIt->second;
 			for (size_t j = 0; j < ports.size(); ++j)
 			{
-				std::string hostPort = host + ":" + Utils::toString(ports[j]);
+				std::string hostPort = Utils::getListenKey(host, ports[j]);
 
 				if (hostPortToServerName.find(hostPort) != hostPortToServerName.end())
 				{
@@ -109,6 +137,27 @@ void ConfigParser::validateServerConflicts() const
 	}
 }
 
+// the limiter and quota tables live in each worker process, so with prefork every worker enforces its own copy
+void ConfigParser::validateWorkerLimits() const
+{
+	if (_workerProcesses < 2)
+		return;
+
+	std::string workers = Utils::toString(_workerProcesses);
+	for (size_t i = 0; i < _servers.size(); ++i)
+	{
+		const std::map<std::string, LocationConfig>& locations = _servers[i].getLocations();
+		bool limitReq = _servers[i].getLimitReq().isEnabled();
+
+		for (std::map<std::string, LocationConfig>::const_iterator it = locations.begin(); it != locations.end(); ++it)
+			limitReq = limitReq || it->second.getLimitReq().isEnabled();
+		if (_servers[i].getLimitConn() > 0 || limitReq)
+			LOG_WARN("server \"" + _servers[i].getServerName() + "\": limit_conn and limit_req are counted per worker process, so a client may get up to " + workers + " times the limit");
+
+		if (_servers[i].getMaxConnections() > 0 || _servers[i].getMaxCgiProcesses() > 0 || _servers[i].getMaxBodyInFlight() > 0)
+			LOG_WARN("server \"" + _servers[i].getServerName() + "\": max_connections, max_cgi_processes and max_body_in_flight are counted per worker process, so the server may use up to " + workers + " times the quota");
+	}
+}
 
 void ConfigParser::parseFile() 
 {
@@ -124,6 +173,7 @@ void ConfigParser::parseFile()
 		throw std::runtime_error("No valid server block found in configuration file");
 
 	validateServerConflicts();
+	validateWorkerLimits();
 	file.close();
 	
 }
@@ -170,6 +220,12 @@ void ConfigParser::parseServerBlocks(std::ifstream& fileStream)
 			continue;
 		}
 
+		if (braceDepth == 0 && !serverFound)
+		{
+			parseGlobalDirective(line);
+			continue;
+		}
+
 		if (serverFound && braceDepth == 0) 
 		{
 			size_t bracePos = line.find('{');
@@ -261,6 +317,50 @@ void ConfigParser::parseServerBlock(const std::string& block)
 }
 
 
+void ConfigParser::parseGlobalDirective(const std::string& line)
+{
+	std::string directiveLine = line.substr(0, line.find(';'));
+	size_t spacePos = directiveLine.find_first_of(" \t");
+
+	if (spacePos == std::string::npos)
+		throw std::runtime_error("Invalid directive format (expected 'key value;'): " + line);
+
+	std::string key = Utils::trim(directiveLine.substr(0, spacePos));
+	std::string value = Utils::trim(directiveLine.substr(spacePos + 1));
+
+	if (value.empty())
+		throw std::runtime_error("Empty directive value for key '" + key + "': " + line);
+
+	if (key == "worker_threads")
+	{
+		_workerThreads = Utils::stringToSizeT(value);
+		if (_workerThreads < 1 || _workerThreads > 256)
+			throw std::runtime_error("worker_threads out of range (1-256): " + value);
+	}
+	else if (key == "worker_processes")
+	{
+		_workerProcesses = Utils::stringToSizeT(value);
+		if (_workerProcesses < 1 || _workerProcesses > 256)
+			throw std::runtime_error("worker_processes out of range (1-256): " + value);
+	}
+	else if (key == "edge_triggered")
+	{
+		if (value != "on" && value != "off")
+			throw std::runtime_error("Invalid edge_triggered value: " + value + " (must be 'on' or 'off')");
+		_edgeTriggered = (value == "on");
+	}
+	else if (key == "max_egress_rate")
+		_maxEgressRate = Utils::stringToSizeT(value);
+	else if (key == "admin_socket")
+	{
+		if (value[0] != '/')
+			throw std::runtime_error("admin_socket must be an absolute path: " + value);
+		_adminSocket = value;
+	}
+	else
+		throw std::runtime_error("Unknown global directive '" + key + "': " + line);
+}
+
 void ConfigParser::parseDirective(const std::string& line, ServerConfig& server) 
 {
 
@@ -288,8 +388,36 @@ void ConfigParser::parseDirective(const std::string& line, ServerConfig& server)
 		server.setClientMaxBodySize(value);
 	else if (key == "client_body_temp_path") 
 		server.setClientBodyTmpPath(value);
+	else if (key == "ssl_certificate")
+		server.setSslCertificate(value);
+	else if (key == "ssl_certificate_key")
+		server.setSslCertificateKey(value);
 	else if (key == "error_page") 
 		server.setErrorPage(value);
+	else if (key == "keepalive_requests")
+		server.setKeepaliveRequests(value);
+	else if (key == "keepalive_timeout")
+		server.setKeepaliveTimeout(value);
+	else if (key == "client_header_timeout")
+		server.setClientHeaderTimeout(value);
+	else if (key == "client_body_timeout")
+		server.setClientBodyTimeout(value);
+	else if (key == "client_body_min_rate")
+		server.setClientBodyMinRate(value);
+	else if (key == "limit_conn")
+		server.setLimitConn(value);
+	else if (key == "limit_req")
+		server.setLimitReq(value);
+	else if (key == "limit_rate")
+		server.setLimitRate(value);
+	else if (key == "limit_rate_after")
+		server.setLimitRateAfter(value);
+	else if (key == "max_connections")
+		server.setMaxConnections(value);
+	else if (key == "max_cgi_processes")
+		server.setMaxCgiProcesses(value);
+	else if (key == "max_body_in_flight")
+		server.setMaxBodyInFlight(value);
 	else
 		throw std::runtime_error("Unknown server directive '" + key + "': " + line);
 }
@@ -330,6 +458,12 @@ void ConfigParser::parseLocationBlock(const std::string& content, LocationConfig
 			location.setUploadPath(value);
 		else if (key == "cgi_path")
 			location.setCgiPath(value);
+		else if (key == "limit_req")
+			location.setLimitReq(value);
+		else if (key == "limit_rate")
+			location.setLimitRate(value);
+		else if (key == "limit_rate_after")
+			location.setLimitRateAfter(value);
 		else
 			throw std::runtime_error("Unknown location directive '" + key + "': " + line);
 	}
@@ -4,9 +4,9 @@
 #include <errno.h>
 #include <unistd.h>
 
-Epoll::Epoll(size_t maxEvents) : _epollFd(-1) , _events(maxEvents)
+Epoll::Epoll(size_t maxEvents) : _epollFd(-1), _ready(0), _events(maxEvents)
 {
-	_epollFd = epoll_create(1);
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
 	if (_epollFd == -1)
 		throw std::runtime_error(std::string("Failed to create epoll: ") + strerror(errno));
 }
@@ -20,26 +20,26 @@ Epoll::~Epoll()
 	}
 }
 
-bool Epoll::add(int fd, uint32_t events)
+bool Epoll::add(int fd, uint32_t events, EventSource* source)
 {
 	if (_epollFd == -1 || fd < 0)
 		return false;
 
 	epoll_event ev = {};
 	ev.events = events;
-	ev.data.fd = fd;
+	ev.data.ptr = source;
 
 	return (epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) != -1);
 }
 
-bool Epoll::modify(int fd, uint32_t events)
+bool Epoll::modify(int fd, uint32_t events, EventSource* source)
 {
 	if (_epollFd == -1 || fd < 0)
 		return false;
 
 	epoll_event ev = {};
 	ev.events = events;
-	ev.data.fd = fd;
+	ev.data.ptr = source;
 
 	return (epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &ev) != -1);
 }
@@ -48,7 +48,15 @@ int Epoll::wait(int timeout)
 {
 	if (_epollFd == -1)
 		return -1;
-	return epoll_wait(_epollFd, _events.data(), _events.size(), timeout);
+	_ready = epoll_wait(_epollFd, _events.data(), _events.size(), timeout);
+	return _ready;
+}
+
+void Epoll::invalidate(EventSource* source)
+{
+	for (int i = 0; i < _ready; ++i)
+		if (_events[i].data.ptr == source)
+			_events[i].data.ptr = NULL;
 }
 
 bool Epoll::remove(int fd)
@@ -59,6 +67,11 @@ bool Epoll::remove(int fd)
 }
 
 
+const char* Epoll::getName() const
+{
+	return "epoll";
+}
+
 int Epoll::getFd() const
 {
 	return _epollFd;
@@ -0,0 +1,910 @@
+#include "../include/EventLoop.hpp"
+#include "../include/Logger.hpp"
+#include "../include/AdminServer.hpp"
+#include "../include/Tunables.hpp"
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <sstream>
+#include <ctime>
+
+Listener::Listener(int listenFd) : EventSource(EventSource::LISTENER), fd(listenFd), limitConn(0), cork(false), http2(false), tls(NULL)
+{
+}
+
+static void rejectConnection(int fd, const std::string& response)
+{
+	if (!response.empty())
+		send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+	shutdown(fd, SHUT_WR);
+	close(fd);
+}
+
+EventLoop::EventLoop(const std::vector<ServerConfig>& servers, const std::vector<int>& serverFds, uint32_t listenEvents, bool edgeTriggered, VhostQuota::Table* usage, RateLimiter* limiter, TokenBucket* egress) : _poller(EventPoller::create(EVENTS)), _wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), _wakeSource(EventSource::WAKEUP), _running(false), _paused(false), _lastShed(0), _listenEvents(listenEvents), _edgeTriggered(edgeTriggered), _limitConns(false), _draining(false), _drainRequested(false), _serverSet(new ServerSet(servers, usage)), _controlCommand(0), _controlPending(false), _admin(NULL), _index(0), _reloadPending(false), _pendingUsage(NULL), _readBuffers(READ_BUFFER_SIZE, 1), _writeBuffers(WRITE_BUFFER_SIZE, WRITE_BUFFERS_CACHED), _pool(Tunables::getInstance().getClients(), edgeTriggered, _readBuffers, _writeBuffers), _timers(TIMER_RESOLUTION), _limiter(limiter), _egress(egress)
+{
+	if (_wakeFd < 0 || !_poller->add(_wakeFd, EPOLLIN, &_wakeSource) || !setListeners(serverFds))
+	{
+		if (_wakeFd >= 0)
+			close(_wakeFd);
+		delete _serverSet;
+		delete _poller;
+		throw std::runtime_error("Failed to add listening sockets to the poller");
+	}
+	pthread_mutex_init(&_controlLock, NULL);
+	pthread_cond_init(&_controlDone, NULL);
+}
+
+EventLoop::~EventLoop()
+{
+	_clients.clear();
+	delete _poller;
+	close(_wakeFd);
+	delete _serverSet;
+	for (size_t i = 0; i < _retiredSets.size(); ++i)
+		delete _retiredSets[i];
+	pthread_cond_destroy(&_controlDone);
+	pthread_mutex_destroy(&_controlLock);
+}
+
+bool EventLoop::setListeners(const std::vector<int>& serverFds)
+{
+	bool armed = !_paused && !_draining;
+
+	// the poller holds listener addresses, so every listener is re-added after the rebuild
+	for (size_t i = 0; armed && i < _listeners.size(); ++i)
+	{
+		_poller->remove(_listeners[i].fd);
+		_poller->invalidate(&_listeners[i]);
+	}
+	_listeners.clear();
+	_listeners.reserve(serverFds.size());
+	for (size_t i = 0; i < serverFds.size(); ++i)
+	{
+		_listeners.push_back(Listener(serverFds[i]));
+		configureListener(_listeners[i]);
+		if (_listeners[i].limitConn > 0)
+			_limitConns = true;
+	}
+
+	bool added = true;
+	for (size_t i = 0; armed && i < _listeners.size(); ++i)
+	{
+		if (!_poller->add(_listeners[i].fd, _listenEvents, &_listeners[i]))
+		{
+			LOG_ERROR("Failed to add socket to epoll (fd " + Utils::toString(_listeners[i].fd) + ")");
+			added = false;
+		}
+	}
+	return added;
+}
+
+void EventLoop::reload(const std::vector<ServerConfig>& servers, const std::vector<int>& serverFds, VhostQuota::Table* usage)
+{
+	pthread_mutex_lock(&_controlLock);
+	_pendingServers = servers;
+	_pendingUsage = usage;
+	_pendingFds = serverFds;
+	_reloadPending = true;
+	pthread_mutex_unlock(&_controlLock);
+	wake();
+}
+
+void EventLoop::waitReload()
+{
+	pthread_mutex_lock(&_controlLock);
+	while (_reloadPending)
+		pthread_cond_wait(&_controlDone, &_controlLock);
+	pthread_mutex_unlock(&_controlLock);
+}
+
+void EventLoop::applyReload()
+{
+	pthread_mutex_lock(&_controlLock);
+	if (!_reloadPending)
+	{
+		pthread_mutex_unlock(&_controlLock);
+		return;
+	}
+
+	// requests in flight finish on the generation they started under
+	ServerSet* previous = _serverSet;
+	size_t remaining = previous->clients;
+	try
+	{
+		_serverSet = new ServerSet(_pendingServers, _pendingUsage);
+	}
+	catch (const std::exception& e)
+	{
+		// certificates are checked before the reload is posted, this only trips if they changed since
+		LOG_ERROR("Reload failed, keeping the current configuration: " + std::string(e.what()));
+		_pendingServers.clear();
+		_pendingFds.clear();
+		_reloadPending = false;
+		pthread_cond_broadcast(&_controlDone);
+		pthread_mutex_unlock(&_controlLock);
+		return;
+	}
+	if (remaining > 0)
+		_retiredSets.push_back(previous);
+	else
+		delete previous;
+	setListeners(_pendingFds);
+	_pendingServers.clear();
+	_pendingFds.clear();
+	_reloadPending = false;
+	pthread_cond_broadcast(&_controlDone);
+	pthread_mutex_unlock(&_controlLock);
+	LOG_INFO("Configuration reloaded, " + Utils::toString(remaining) + " connection(s) move over after their current request");
+}
+
+void EventLoop::setAdmin(AdminServer* admin)
+{
+	_admin = admin;
+}
+
+void EventLoop::setIndex(size_t index)
+{
+	_index = index;
+}
+
+EventPoller* EventLoop::getPoller()
+{
+	return _poller;
+}
+
+std::string EventLoop::control(Control command)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 1;
+
+	pthread_mutex_lock(&_controlLock);
+	_controlCommand = command;
+	_controlPending = true;
+	pthread_mutex_unlock(&_controlLock);
+	wake();
+
+	pthread_mutex_lock(&_controlLock);
+	while (_controlPending)
+		if (pthread_cond_timedwait(&_controlDone, &_controlLock, &deadline) == ETIMEDOUT)
+			break;
+	std::string result = _controlPending ? "loop " + Utils::toString(_index) + ": not responding\n" : _controlResult;
+	_controlPending = false;
+	_controlResult.clear();
+	pthread_mutex_unlock(&_controlLock);
+	return result;
+}
+
+void EventLoop::applyControl()
+{
+	pthread_mutex_lock(&_controlLock);
+	if (!_controlPending)
+	{
+		pthread_mutex_unlock(&_controlLock);
+		return;
+	}
+	Control command = static_cast<Control>(_controlCommand);
+	pthread_mutex_unlock(&_controlLock);
+
+	std::string result = runControl(command);
+
+	pthread_mutex_lock(&_controlLock);
+	_controlResult = result;
+	_controlPending = false;
+	pthread_cond_broadcast(&_controlDone);
+	pthread_mutex_unlock(&_controlLock);
+}
+
+std::string EventLoop::runControl(Control command)
+{
+	if (command == CONTROL_TRIM)
+		return trimCaches();
+	return dumpState();
+}
+
+std::string EventLoop::trimCaches()
+{
+	size_t buffers = _readBuffers.trim() + _writeBuffers.trim();
+	size_t clients = _pool.trim();
+	size_t entries = _limiter->purge();
+
+	return "loop " + Utils::toString(_index) + ": released " + Utils::toString(buffers) + " buffer bytes, " + Utils::toString(clients) + " pooled clients, " + Utils::toString(entries) + " limiter entries\n";
+}
+
+static const char* getStateName(int state)
+{
+	static const char* names[] = { "init", "method", "uri", "protocol", "header", "body_init", "cgi", "chunked", "multipart", "finish", "error" };
+
+	if (state < 0 || state > HTTPRequest::ERROR)
+		return "unknown";
+	return names[state];
+}
+
+std::string EventLoop::dumpState() const
+{
+	uint64_t now = TimerWheel::now();
+	std::ostringstream out;
+
+	out << "loop " << _index << ": " << _poller->getName()
+		<< " clients " << _pool.inUse() << "/" << _pool.capacity()
+		<< " idle " << _idle.size()
+		<< " deferred " << _runQueue.size()
+		<< " cgi " << _cgiPending.size()
+		<< " listeners " << _listeners.size() << (_paused ? " paused" : "") << (_draining ? " draining" : "")
+		<< " write_buffers " << _writeBuffers.getBytesInUse() << "+" << _writeBuffers.getBytesCached()
+		<< " limiter " << _limiter->size()
+		<< " generations " << 1 + _retiredSets.size() << "\n";
+	for (size_t fd = 0; fd < _clients.size(); ++fd)
+	{
+		Client* client = _clients[fd];
+		if (!client)
+			continue;
+		HTTPRequest* request = client->getRequest();
+		out << "  fd " << fd << " " << client->getPeer().toString()
+			<< " state " << getStateName(request->getState())
+			<< (client->hasStartedResponse() ? " responding" : "")
+			<< (client->isThrottled() ? " throttled" : "")
+			<< (client->isReadPaused() ? " read_paused" : "")
+			<< (client->getHttp2() ? " h2 streams " + Utils::toString(client->getHttp2()->getStreamCount()) : "")
+			<< (client->isTls() ? (client->isHandshaking() ? " tls_handshake" : client->hasKernelTls() ? " ktls" : " tls") : "")
+			<< " server " << request->getServer().getServerName()
+			<< " idle_ms " << now - client->getLastActivity()
+			<< (client->getServerSet() != _serverSet ? " previous_config" : "") << "\n";
+	}
+	return out.str();
+}
+
+void EventLoop::drain()
+{
+	_drainRequested = true;
+	wake();
+}
+
+void EventLoop::wake()
+{
+	uint64_t one = 1;
+
+	// stop() runs inside the signal handler, so nothing here may allocate or log
+	ssize_t written = write(_wakeFd, &one, sizeof(one));
+	(void) written;
+}
+
+void EventLoop::beginDrain()
+{
+	if (!_paused)
+	{
+		for (size_t i = 0; i < _listeners.size(); ++i)
+		{
+			_poller->remove(_listeners[i].fd);
+			_poller->invalidate(&_listeners[i]);
+		}
+	}
+	_paused = false;
+	_draining = true;
+	LOG_INFO("Draining " + Utils::toString(_pool.inUse()) + " connection(s)");
+}
+
+void EventLoop::closeIdleClients(uint64_t idleFor)
+{
+	uint64_t now = TimerWheel::now();
+
+	// a connection that was just active may have its next request in flight, it gets one last response instead
+	while (IdleList::Node* node = _idle.oldest())
+	{
+		Client* client = static_cast<Client*>(node->data);
+		if (now - client->getLastActivity() < idleFor)
+			break;
+		cleanupClient(client);
+	}
+}
+
+void EventLoop::migrateClient(Client* client)
+{
+	ServerSet* previous = client->getServerSet();
+
+	client->setServerSet(_serverSet);
+	++_serverSet->clients;
+	releaseServerSet(previous);
+}
+
+void EventLoop::releaseServerSet(ServerSet* serverSet)
+{
+	if (--serverSet->clients > 0 || serverSet == _serverSet)
+		return;
+	for (size_t i = 0; i < _retiredSets.size(); ++i)
+	{
+		if (_retiredSets[i] == serverSet)
+		{
+			_retiredSets.erase(_retiredSets.begin() + i);
+			break;
+		}
+	}
+	delete serverSet;
+}
+
+const char* EventLoop::getBackendName() const
+{
+	return _poller->getName();
+}
+
+void EventLoop::run()
+{
+	_running = true;
+	while (_running)
+	{
+		try {
+			applyReload();
+			applyControl();
+			if (_pool.capacity() != Tunables::getInstance().getClients())
+				_pool.setCapacity(Tunables::getInstance().getClients());
+			if (_drainRequested && !_draining)
+				beginDrain();
+			if (_draining)
+				closeIdleClients(DRAIN_IDLE_GRACE);
+			if (_draining && _pool.inUse() == 0)
+				break;
+
+			int numEvents = _poller->wait(getWaitTimeout());
+
+			if (numEvents < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				else
+					throw std::runtime_error("epoll_wait failed");
+			}
+			for (int i = 0; i < numEvents; ++i)
+				handleEvent(_poller->getEvent(i));
+			runDeferred();
+			pollCgiClients();
+			expireTimers();
+			if (_paused)
+				checkOverload();
+		}
+		catch (const std::exception& e)
+		{
+			LOG_ERROR("ERROR in main event loop " + std::string(e.what()));
+		}
+	}
+	_running = false;
+}
+
+void EventLoop::stop()
+{
+	_running = false;
+	wake();
+}
+
+void EventLoop::handleEvent(const epoll_event& event)
+{
+	EventSource* source = static_cast<EventSource*>(event.data.ptr);
+	uint32_t events = event.events;
+
+	if (!source)
+		return;
+	if (source->type == EventSource::WAKEUP)
+	{
+		uint64_t count;
+		if (read(_wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOG_DEBUG("Failed to clear event loop wakeup");
+		return;
+	}
+	if (source->type == EventSource::ADMIN)
+		return _admin->handleEvent(source, events);
+	if (source->type == EventSource::LISTENER)
+	{
+		if (events & EPOLLIN)
+			acceptClient(static_cast<Listener*>(source));
+		return;
+	}
+
+	Client* client = static_cast<Client*>(source);
+	try {
+		if (events & EPOLLHUP)
+			throw std::runtime_error("EPOLL hangup fd " + Utils::toString(client->getFd()) + ", events: " + Utils::toString(events));
+
+		if (events & EPOLLERR)
+			throw std::runtime_error("EPOLL error fd " + Utils::toString(client->getFd()) + ", events: " + Utils::toString(events));
+
+		client->updateActivity();
+		if (events & (EPOLLIN | EPOLLRDHUP))
+			client->setReadable(true);
+		if (events & EPOLLOUT)
+			client->setWritable(true);
+		// a TLS record may need the opposite direction before a read or write can go on
+		if (client->getTlsBlocked() & events)
+			client->resumeTls();
+		// a deferred client keeps its place in the run queue
+		if (!client->getRunNode()->isLinked())
+			processClient(client);
+	}
+	catch (const std::exception& e)
+	{
+		LOG_ERROR(e.what());
+		cleanupClient(client);
+	}
+}
+
+void EventLoop::processClient(Client* client)
+{
+	int fd = client->getFd();
+
+	client->refillBudget();
+	while (true)
+	{
+		if (!client->hasBudget())
+			return deferClient(client);
+		if (client->isHandshaking() && !client->handshake())
+			return suspendClient(client, 0);
+		if (client->getHttp2())
+			return processStreams(client);
+		// between requests nothing refers to the old configuration, so keep-alive connections move over
+		if (client->getServerSet() != _serverSet && client->getRequest()->getState() == HTTPRequest::INIT)
+			migrateClient(client);
+
+		if (!client->getRequest()->isComplete())
+		{
+			if (client->isReadable() && !client->isReadPaused())
+				client->readRequest();
+			if (client->getHttp2())
+				continue;
+			if (client->isReadable() && !client->isReadPaused() && !client->hasBudget())
+				return deferClient(client);
+			if (!client->getRequest()->isComplete())
+				return suspendClient(client, client->isReadPaused() ? 0 : static_cast<uint32_t>(EPOLLIN));
+		}
+
+		if (!client->hasStartedResponse())
+		{
+			if (!_draining && client->upgradeHttp2())
+				continue;
+			// a draining loop closes every connection once its response is sent
+			if (_draining)
+				client->getResponse()->disableKeepAlive();
+			client->startResponse();
+		}
+
+		if (!client->getResponse()->isReady())
+		{
+			_cgiPending.insert(fd);
+			return suspendClient(client, 0);
+		}
+		_cgiPending.erase(fd);
+
+		if (client->isWritable())
+			client->sendResponse();
+		if (client->isWritable() && !client->isThrottled() && !client->hasBudget() && !client->getResponse()->isComplete())
+			return deferClient(client);
+		if (!client->getResponse()->isComplete())
+			return suspendClient(client, client->isWritable() ? 0 : static_cast<uint32_t>(EPOLLOUT));
+
+		if (!client->shouldKeepAlive())
+			return cleanupClient(client);
+
+		client->reset();
+		if (client->hasBufferedInput())
+			client->parseBufferedInput();
+	}
+}
+
+// frames are read, streams advanced and output written until the socket blocks in both directions
+void EventLoop::processStreams(Client* client)
+{
+	Http2Connection* http2 = client->getHttp2();
+	int fd = client->getFd();
+
+	while (true)
+	{
+		if (!client->hasBudget())
+			return deferClient(client);
+		if (client->getServerSet() != _serverSet && http2->getStreamCount() == 0)
+			migrateClient(client);
+
+		if (client->isReadable() && !client->isReadPaused())
+			client->readRequest();
+		http2->process(_draining);
+		if (http2->isWaiting())
+			_cgiPending.insert(fd);
+		else
+			_cgiPending.erase(fd);
+
+		if (client->isWritable() && !client->isThrottled() && client->hasPendingOutput())
+			client->sendResponse();
+		if (http2->isFinished() && !client->hasPendingOutput())
+			return cleanupClient(client);
+
+		bool canRead = client->isReadable() && !client->isReadPaused();
+		bool canWrite = client->isWritable() && !client->isThrottled() && client->hasPendingOutput();
+		if (!canRead && !canWrite)
+			break;
+	}
+	uint32_t events = client->isReadPaused() ? 0 : static_cast<uint32_t>(EPOLLIN);
+	if (client->hasPendingOutput() && !client->isThrottled())
+		events |= EPOLLOUT;
+	suspendClient(client, events);
+}
+
+void EventLoop::suspendClient(Client* client, uint32_t events)
+{
+	updateInterest(client, events | client->getTlsBlocked());
+	if (client->isKeepAliveIdle())
+		_idle.touch(client->getIdleNode());
+	else
+		_idle.remove(client->getIdleNode());
+	armTimer(client);
+}
+
+void EventLoop::deferClient(Client* client)
+{
+	_idle.remove(client->getIdleNode());
+	_runQueue.touch(client->getRunNode());
+	armTimer(client);
+}
+
+void EventLoop::runDeferred()
+{
+	// clients deferred during this pass wait for the next iteration
+	for (size_t count = _runQueue.size(); count > 0 && _runQueue.size() > 0; --count)
+	{
+		IdleList::Node* node = _runQueue.oldest();
+		Client* client = static_cast<Client*>(node->data);
+
+		_runQueue.remove(node);
+		try
+		{
+			processClient(client);
+		}
+		catch (const std::exception& e)
+		{
+			LOG_ERROR(e.what());
+			cleanupClient(client);
+		}
+	}
+}
+
+void EventLoop::updateInterest(Client* client, uint32_t events)
+{
+	if (_edgeTriggered || client->getInterest() == events)
+		return;
+	if (!_poller->modify(client->getFd(), events, client))
+		throw std::runtime_error("Failed to modify epoll events for fd " + Utils::toString(client->getFd()));
+	client->setInterest(events);
+}
+
+void EventLoop::pollCgiClients()
+{
+	if (_cgiPending.empty())
+		return;
+
+	std::vector<int> pending(_cgiPending.begin(), _cgiPending.end());
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		Client* client = _clients[pending[i]];
+		try
+		{
+			processClient(client);
+		}
+		catch (const std::exception& e)
+		{
+			LOG_ERROR(e.what());
+			cleanupClient(client);
+		}
+	}
+}
+
+void EventLoop::acceptClient(Listener* listener)
+{
+	int fd = listener->fd;
+
+	for (int accepted = 0; accepted < ACCEPT_BUDGET; ++accepted)
+	{
+		if (isOverloaded())
+		{
+			rejectPending(*listener);
+			return pauseListeners();
+		}
+
+		struct sockaddr_storage clientAddr;
+		socklen_t clientAddrLen = sizeof(clientAddr);
+
+		int clientFd = accept4(fd, (struct sockaddr *)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (clientFd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LOG_WARN("accept4() failed on fd " + Utils::toString(fd) + ": " + strerror(errno));
+			return;
+		}
+
+		PeerAddress peer(reinterpret_cast<struct sockaddr*>(&clientAddr));
+		std::string origin = peer.toString();
+		if (clientAddr.ss_family == AF_INET)
+			origin += ":" + Utils::toString(ntohs(reinterpret_cast<struct sockaddr_in*>(&clientAddr)->sin_port));
+		else if (clientAddr.ss_family == AF_INET6)
+			origin = "[" + origin + "]:" + Utils::toString(ntohs(reinterpret_cast<struct sockaddr_in6*>(&clientAddr)->sin6_port));
+		LOG_INFO("Client connected from " + origin + " (fd " + Utils::toString(clientFd) + ")");
+
+		if (_limitConns && !_limiter->acquireConnection(peer, listener->limitConn))
+		{
+			LOG_DEBUG("Connection limit exceeded for " + peer.toString());
+			rejectConnection(clientFd, listener->tooMany);
+			continue;
+		}
+		if (!registerClient(clientFd, peer, listener) && _limitConns)
+			_limiter->releaseConnection(peer);
+	}
+}
+
+bool EventLoop::registerClient(int clientFd, const PeerAddress& peer, const Listener* listener)
+{
+	if (_pool.inUse() >= _pool.capacity())
+		evictIdleClient();
+
+	try
+	{
+		Client* client = _pool.acquire(clientFd, peer, _serverSet);
+		if (!client)
+		{
+			close(clientFd);
+			return false;
+		}
+
+		if (listener->tls)
+		{
+			SSL* ssl = listener->tls->createSession(clientFd);
+			if (!ssl)
+			{
+				LOG_WARN("Failed to create TLS session for fd " + Utils::toString(clientFd) + ": " + TlsContext::getError());
+				_pool.release(client);
+				return false;
+			}
+			client->startTls(ssl);
+		}
+
+		uint32_t events = EPOLLIN;
+		if (_edgeTriggered)
+			events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		if (!_poller->add(clientFd, events, client))
+		{
+			_pool.release(client);
+			return false;
+		}
+		++_serverSet->clients;
+		client->setRateLimiter(_limiter);
+		client->setHttp2(listener->http2);
+		client->setEgressBucket(_egress);
+		client->setCork(listener->cork);
+		if (static_cast<size_t>(clientFd) >= _clients.size())
+			_clients.resize(clientFd + 1, NULL);
+		_clients[clientFd] = client;
+		armTimer(client);
+		return true;
+	}
+
+	catch (const std::exception& e)
+	{
+		LOG_DEBUG(e.what());
+		close(clientFd);
+	}
+	return false;
+}
+
+void EventLoop::configureListener(Listener& listener) const
+{
+	std::string host;
+	uint16_t port;
+
+	if (!Utils::getSocketAddress(listener.fd, host, port))
+		return;
+
+	// the first server bound to the address is the default one for it
+	const std::vector<ServerConfig>& servers = _serverSet->servers;
+	for (size_t i = 0; i < servers.size(); ++i)
+	{
+		std::vector<uint16_t> ports = servers[i].getPortsByHost(host);
+		for (size_t j = 0; j < ports.size(); ++j)
+			if (ports[j] == port)
+			{
+				listener.limitConn = servers[i].getLimitConn();
+				listener.cork = servers[i].getListenOptions(host, port).cork;
+				listener.tls = _serverSet->getTlsContext(Utils::getListenKey(host, port));
+				listener.http2 = _serverSet->hasHttp2(Utils::getListenKey(host, port));
+				// a TLS client cannot read a plain reply, it only sees the connection close
+				listener.tooMany = listener.tls ? "" : HTTPResponse::buildRejection(servers[i], 429);
+				listener.unavailable = listener.tls ? "" : HTTPResponse::buildRejection(servers[i], 503);
+				return;
+			}
+	}
+}
+
+bool EventLoop::isOverloaded() const
+{
+	if (_writeBuffers.getBytesInUse() >= static_cast<size_t>(WRITE_MEMORY_BUDGET))
+		return true;
+	if (_pool.inUse() < _pool.capacity())
+		return false;
+	return _idle.size() == 0;
+}
+
+bool EventLoop::hasHeadroom() const
+{
+	if (_writeBuffers.getBytesInUse() >= static_cast<size_t>(WRITE_MEMORY_BUDGET) / 10 * 9)
+		return false;
+	return _pool.inUse() <= _pool.capacity() / 10 * 9 || _idle.size() > 0;
+}
+
+void EventLoop::rejectPending(const Listener& listener)
+{
+	for (int rejected = 0; rejected < OVERLOAD_REJECTS; ++rejected)
+	{
+		int clientFd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientFd == -1)
+			return;
+		rejectConnection(clientFd, listener.unavailable);
+	}
+}
+
+void EventLoop::pauseListeners()
+{
+	if (_paused || _draining)
+		return;
+	for (size_t i = 0; i < _listeners.size(); ++i)
+	{
+		_poller->remove(_listeners[i].fd);
+		_poller->invalidate(&_listeners[i]);
+	}
+	_paused = true;
+	_lastShed = TimerWheel::now();
+	LOG_WARN("Overloaded (" + Utils::toString(_pool.inUse()) + " clients), pausing listeners");
+}
+
+void EventLoop::checkOverload()
+{
+	if (hasHeadroom())
+		return resumeListeners();
+
+	uint64_t now = TimerWheel::now();
+	if (now - _lastShed < 1000)
+		return;
+	_lastShed = now;
+	for (size_t i = 0; i < _listeners.size(); ++i)
+		rejectPending(_listeners[i]);
+}
+
+void EventLoop::resumeListeners()
+{
+	for (size_t i = 0; i < _listeners.size(); ++i)
+		if (!_poller->add(_listeners[i].fd, _listenEvents, &_listeners[i]))
+			LOG_ERROR("Failed to re-arm listener fd " + Utils::toString(_listeners[i].fd));
+	_paused = false;
+	LOG_INFO("Load dropped (" + Utils::toString(_pool.inUse()) + " clients), resuming listeners");
+}
+
+bool EventLoop::evictIdleClient()
+{
+	IdleList::Node* node = _idle.oldest();
+	if (!node)
+		return false;
+
+	Client* client = static_cast<Client*>(node->data);
+	LOG_DEBUG("Evicting idle keep-alive client " + Utils::toString(client->getFd()));
+	cleanupClient(client);
+	return true;
+}
+
+int EventLoop::getWaitTimeout() const
+{
+	if (_runQueue.size() > 0)
+		return 0;
+
+	int timeout = _timers.nextTimeout(TimerWheel::now());
+
+	if (timeout < 0 || timeout > 1000)
+		timeout = 1000;
+	if (!_cgiPending.empty() && timeout > CGI_POLL_INTERVAL)
+		timeout = CGI_POLL_INTERVAL;
+	return timeout;
+}
+
+uint64_t EventLoop::getDeadline(Client* client) const
+{
+	if (_cgiPending.count(client->getFd()))
+		return client->getLastActivity() + Tunables::getInstance().getCgiTimeout() * 1000;
+	if (client->isThrottled())
+		return client->getThrottleUntil();
+	if (client->isKeepAliveIdle())
+		return client->getLastActivity() + client->getKeepaliveTimeout() * 1000;
+	if (!client->getRequest()->isComplete() && !client->getHttp2())
+		return client->getRequestDeadline();
+	return client->getLastActivity() + Tunables::getInstance().getTimeout() * 1000;
+}
+
+void EventLoop::armTimer(Client* client)
+{
+	TimerWheel::Timer* timer = client->getTimer();
+	uint64_t deadline = getDeadline(client);
+
+	// a pending timer that fires early is pushed back when it expires
+	if (!timer->isPending() || timer->expires > deadline)
+		_timers.schedule(timer, deadline);
+}
+
+void EventLoop::expireTimers()
+{
+	uint64_t now = TimerWheel::now();
+
+	_expired.clear();
+	_timers.advance(now, _expired);
+	for (size_t i = 0; i < _expired.size(); ++i)
+	{
+		Client* client = static_cast<Client*>(_expired[i]->data);
+		uint64_t deadline = getDeadline(client);
+
+		if (deadline > now)
+			_timers.schedule(_expired[i], deadline);
+		else
+			handleTimeout(client);
+	}
+}
+
+void EventLoop::handleTimeout(Client* client)
+{
+	int fd = client->getFd();
+
+	// idle sockets and stalled writes are dropped, a request that started arriving gets a 408
+	if (!client->isThrottled() && !_cgiPending.count(fd) && (client->getRequest()->isComplete() || client->getRequest()->getState() == HTTPRequest::INIT))
+	{
+		LOG_DEBUG("Client timed out  " + Utils::toString(fd));
+		return cleanupClient(client);
+	}
+
+	try
+	{
+		if (client->isThrottled())
+			client->resumeSending();
+		else if (_cgiPending.count(fd))
+		{
+			_cgiPending.erase(fd);
+			client->abortCgi();
+			client->updateActivity();
+		}
+		else
+		{
+			LOG_DEBUG("Request " + std::string(client->isReceivingBody() ? "body" : "header") + " timed out on fd " + Utils::toString(fd));
+			client->timeoutRequest();
+		}
+		processClient(client);
+	}
+	catch (const std::exception& e)
+	{
+		LOG_ERROR(e.what());
+		cleanupClient(client);
+	}
+}
+
+void EventLoop::cleanupClient(Client* client)
+{
+	int fd = client->getFd();
+
+	_poller->remove(fd);
+	_poller->invalidate(client);
+	_cgiPending.erase(fd);
+	_timers.cancel(client->getTimer());
+	_idle.remove(client->getIdleNode());
+	_runQueue.remove(client->getRunNode());
+	if (_limitConns)
+		_limiter->releaseConnection(client->getPeer());
+	_clients[fd] = NULL;
+	ServerSet* serverSet = client->getServerSet();
+	_pool.release(client);
+	releaseServerSet(serverSet);
+	LOG_DEBUG("Client disconnected  " + Utils::toString(fd));
+}
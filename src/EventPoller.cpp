@@ -0,0 +1,15 @@
+#include "../include/EventPoller.hpp"
+#include "../include/Epoll.hpp"
+
+EventSource::EventSource(Type sourceType) : type(sourceType)
+{
+}
+
+EventPoller::~EventPoller()
+{
+}
+
+EventPoller* EventPoller::create(size_t maxEvents)
+{
+	return new Epoll(maxEvents);
+}
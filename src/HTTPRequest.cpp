@@ -23,11 +23,20 @@
 #include <iostream>
 
 
-HTTPRequest::HTTPRequest(std::vector<ServerConfig>& servers)
-	: _server(servers[0]),
-	 _servers(servers),
+static const LocationConfig& noLocation()
+{
+	static const LocationConfig empty;
+	return empty;
+}
+
+HTTPRequest::HTTPRequest()
+	: _server(NULL),
+	 _servers(NULL),
+	_location(&noLocation()),
 	_statusCode(200),
 	_state(INIT),
+	_parsePosition(0),
+	_headerSize(0),
 	_contentLength(0),
 	_method(""),
 	_uri("/"),
@@ -46,7 +55,13 @@ HTTPRequest::HTTPRequest(std::vector<ServerConfig>& servers)
 	_multipartState(PART_HEADER),
 	_chunkState(CHUNK_SIZE),
 	_bodyFile(""),
-	_totalBodySize(0)
+	_totalBodySize(0),
+	_client_fd(-1),
+	_limiter(NULL),
+	_quota(NULL),
+	_quotaServer(NULL),
+	_quotaCgi(false),
+	_quotaBody(0)
 {
 }
 
@@ -67,6 +82,27 @@ void HTTPRequest::setClientfd(int fd)
 	_client_fd = fd;
 }
 
+void HTTPRequest::setPeer(const PeerAddress& peer)
+{
+	_peer = peer;
+}
+
+void HTTPRequest::setServers(const std::vector<ServerConfig>& servers)
+{
+	_servers = &servers;
+	_server = &servers[0];
+}
+
+void HTTPRequest::setRateLimiter(RateLimiter* limiter)
+{
+	_limiter = limiter;
+}
+
+void HTTPRequest::setQuota(VhostQuota* quota)
+{
+	_quota = quota;
+}
+
 bool HTTPRequest::keepAlive() const 
 {
 	return _keepAlive;
@@ -82,10 +118,26 @@ bool HTTPRequest::isComplete() const
 	return (_state == FINISH || _state == ERROR);
 }
 
+// a request that failed before its body was read leaves the rest of it on the connection
+bool HTTPRequest::hasUnreadBody() const
+{
+	if (_state != ERROR)
+		return false;
+	if (!getHeader("transfer-encoding").empty())
+		return true;
+
+	const std::string& cl = getHeader("content-length");
+	if (cl.empty())
+		return false;
+	if (cl.find_first_not_of("0123456789") != std::string::npos)
+		return true;
+	return Utils::stringToSizeT(cl) > _length;
+}
+
 
 bool HTTPRequest::hasCgi()
 {
-	if (_location.hasCgi())
+	if (_location->hasCgi())
 		return true;
 
 	return false;
@@ -138,7 +190,7 @@ int HTTPRequest::getStatusCode() const
 
 const ServerConfig& HTTPRequest::getServer() const 
 {
-    return _server;
+    return *_server;
 }
 
 size_t HTTPRequest::getContentLength() const 
@@ -173,7 +225,7 @@ std::string HTTPRequest::getQueryParameter(const std::string& key) const
 
 const LocationConfig& HTTPRequest::getLocation() const 
 {
-	return _location;
+	return *_location;
 }
 
 void HTTPRequest::parseRequest(std::string& data) 
@@ -198,10 +250,17 @@ void HTTPRequest::parseRequest(std::string& data)
 	if (_state == CHUNKED)
 		parseChunkBody(data);
 	if (_state == MULTIPART)
-		parseMultipartBody(data);
+		readMultipartBody(data);
+	if (_state == DISCARD)
+		discardBody(data);
 
 	if (_state == FINISH || _state == ERROR)
 		return;
+	if (_state <= HEADER && data.size() >= READ_HIGH_WATERMARK)
+	{
+		setStatusCode(_state <= URI ? 414 : 431);
+		setState(ERROR);
+	}
 }
 
 void HTTPRequest::parseMethod(std::string& data) 
@@ -298,6 +357,10 @@ void HTTPRequest::parseHeaders(std::string& data)
 
 	size_t sep_len = 2;
 
+	_headerSize += line_end + sep_len;
+	if (_headerSize > READ_HIGH_WATERMARK)
+		return (setState(ERROR), setStatusCode(431));
+
 	std::string line = data.substr(0, line_end);
 
 	if (line.empty()) 
@@ -353,9 +416,11 @@ bool HTTPRequest::validateCgi()
 {
 	if (!hasCgi())
 		return true;
+	if (!acquireQuota(VhostQuota::CGI, 1))
+		return false;
 	try 
 	{
-		_bodyFile = Utils::createTempFile("body_", _server.getClientBodyTmpPath());
+		_bodyFile = Utils::createTempFile("body_", _server->getClientBodyTmpPath());
 		_body.open(_bodyFile.c_str(), std::ios::binary);
 		if (!_body.is_open())
 		{
@@ -386,7 +451,9 @@ void HTTPRequest::writeBodyToFile(std::string& data)
 		return;
 	}
 
-	_body.write(data.c_str(), data.size());
+	size_t length = std::min(data.size(), _contentLength - _length);
+
+	_body.write(data.c_str(), length);
 	if (!_body.good()) 
 	{
 		setStatusCode(500);
@@ -395,9 +462,8 @@ void HTTPRequest::writeBodyToFile(std::string& data)
 		return;
 	}
 
-	_length += data.size();
-
-	data.clear();
+	_length += length;
+	data.erase(0, length);
 
 	if (_length >= _contentLength)
 	{
@@ -406,14 +472,12 @@ void HTTPRequest::writeBodyToFile(std::string& data)
 	}
 }
 
-std::string HTTPRequest:: getSocketIp(int fd)
+std::string HTTPRequest:: getSocketIp(int fd, uint16_t& port)
 {
-	struct sockaddr_in addr;
-	socklen_t len = sizeof(addr);
-	if (getsockname(fd, (struct sockaddr*)&addr, &len) == -1)
+	std::string ip;
+	if (!Utils::getSocketAddress(fd, ip, port))
 		throw std::runtime_error("getsockname failed");
-
-	return inet_ntoa(addr.sin_addr);
+	return ip;
 }
 
 const ServerConfig& HTTPRequest::findServerByHost(const std::string& value)
@@ -421,7 +485,8 @@ const ServerConfig& HTTPRequest::findServerByHost(const std::string& value)
 	std::string host;
 	uint16_t port = 0;
 
-	size_t pos = value.find(':');
+	// an IPv6 literal host carries its own colons inside the brackets
+	size_t pos = value.find(':', value[0] == '[' ? value.find(']') : 0);
 	if (pos != std::string::npos)
 	{
 		host = value.substr(0, pos);
@@ -430,15 +495,19 @@ const ServerConfig& HTTPRequest::findServerByHost(const std::string& value)
 	else
 		host = value;
 
-	std::string ip = getSocketIp(_client_fd);
+	uint16_t socketPort;
+	std::string ip = getSocketIp(_client_fd, socketPort);
+	// a unix socket has no port for the Host header to name
+	if (socketPort == 0)
+		port = 0;
 
 	std::map<std::string, std::vector<uint16_t> >::const_iterator it;
 
-	for (size_t i = 0; i < _servers.size(); ++i)
+	for (size_t i = 0; i < _servers->size(); ++i)
 	{
-		if (_servers[i].getServerName() == host)
+		if ((*_servers)[i].getServerName() == host)
 		{
-			const std::map<std::string, std::vector<uint16_t> >& host_ports = _servers[i].getHostPort();
+			const std::map<std::string, std::vector<uint16_t> >& host_ports = (*_servers)[i].getHostPort();
 			it = host_ports.begin();
 			for (it = host_ports.begin(); it != host_ports.end(); ++it)
 			{
@@ -447,15 +516,15 @@ const ServerConfig& HTTPRequest::findServerByHost(const std::string& value)
 					const std::vector<uint16_t>& ports = it->second;
 					for (size_t j = 0; j < ports.size(); ++j)
 						if (port == 0 || ports[j] == port)
-							return _servers[i];
+							return (*_servers)[i];
 				}
 			}
 		}
 	}
 
-	for (size_t i = 0; i < _servers.size(); ++i)
+	for (size_t i = 0; i < _servers->size(); ++i)
 	{
-		const std::map<std::string, std::vector<uint16_t> >& host_ports = _servers[i].getHostPort();
+		const std::map<std::string, std::vector<uint16_t> >& host_ports = (*_servers)[i].getHostPort();
 		it = host_ports.begin();
 		for (it = host_ports.begin(); it != host_ports.end(); ++it)
 		{
@@ -464,11 +533,11 @@ const ServerConfig& HTTPRequest::findServerByHost(const std::string& value)
 				const std::vector<uint16_t>& ports = it->second;
 				for (size_t j = 0; j < ports.size(); ++j)
 					if (port == 0 || ports[j] == port)
-						return _servers[i];
+						return (*_servers)[i];
 			}
 		}
 	}
-	return _servers[0];
+	return (*_servers)[0];
 }
 
 
@@ -477,6 +546,8 @@ void HTTPRequest::parseBody()
 	if (_state == BODY_INIT) 
 	{
 		if (!validateHostHeader() ||
+			!validateRateLimit() ||
+			!validateQuota() ||
 			!validateAllowedMethods() ||
 			!validateContentLength() ||
 			!validateMultipartFormData() ||
@@ -491,7 +562,7 @@ void HTTPRequest::parseChunkBody(std::string& data)
 {
 	if (!_body.is_open()) 
 	{
-		_bodyFile = Utils::createTempFile("body_", _server.getClientBodyTmpPath());
+		_bodyFile = Utils::createTempFile("body_", _server->getClientBodyTmpPath());
 		_body.open(_bodyFile.c_str(), std::ios::binary);
 		if (!_body.is_open()) 
 		{
@@ -515,6 +586,11 @@ void HTTPRequest::parseChunkBody(std::string& data)
 			if (!readChunkData(data))
 				return;
 		}
+		else if (_chunkState == CHUNK_TRAILER) 
+		{
+			if (!readChunkTrailer(data))
+				return;
+		}
 	}
 }
 
@@ -535,31 +611,46 @@ bool HTTPRequest::readChunkSize(std::string& data)
 		return false;
 	}
 	data.erase(0, pos + 2);
-	if (_chunkSize == 0) 
+	_chunkState = _chunkSize == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+	return true;
+}
+
+bool HTTPRequest::readChunkData(std::string& data) 
+{
+	size_t available = std::min(data.size(), static_cast<size_t>(_chunkSize));
+
+	if (available > 0)
 	{
-		size_t pos = data.find("\r\n");
-		if (pos == std::string::npos)
+		_totalBodySize += available;
+		if (_totalBodySize > _server->getClientMaxBodySize()) 
+		{
+			setStatusCode(413);
+			setState(ERROR);
+			_body.close();
 			return false;
-
-		if (pos == 0)
+		}
+		if (!acquireQuota(VhostQuota::BODY_BYTES, available))
 		{
-			data.erase(0, 2);
 			_body.close();
-			setStatusCode(200);
-			setState(FINISH);
 			return false;
 		}
+		// chunk data is consumed as it arrives so a huge chunk never sits in memory
+		if (isMultipart())
+		{
+			_bodyBuffer.append(data, 0, available);
+			parseMultipartBody(_bodyBuffer);
+			if (_state == ERROR)
+				return false;
+		}
+		else 
+			_body.write(data.c_str(), available);
+		data.erase(0, available);
+		_chunkSize -= available;
 	}
-	_chunkState = CHUNK_DATA;
-	return true;
-}
-
-bool HTTPRequest::readChunkData(std::string& data) 
-{
-	if (data.size() < static_cast<size_t>(_chunkSize + 2))
+	if (_chunkSize > 0 || data.size() < 2)
 		return false;
 
-	if (data[_chunkSize] != '\r' || data[_chunkSize + 1] != '\n') 
+	if (data[0] != '\r' || data[1] != '\n') 
 	{
 		setStatusCode(400);
 		setState(ERROR);
@@ -567,25 +658,31 @@ bool HTTPRequest::readChunkData(std::string& data)
 		return false;
 	}
 
-	_totalBodySize += _chunkSize;
-	if (_totalBodySize > _server.getClientMaxBodySize()) 
+	data.erase(0, 2);
+	_chunkState = CHUNK_SIZE;
+	return true;
+}
+
+// trailer fields are read and ignored, the empty line after them ends the body
+bool HTTPRequest::readChunkTrailer(std::string& data) 
+{
+	size_t pos = data.find("\r\n");
+	if (pos == std::string::npos)
+		return false;
+
+	data.erase(0, pos + 2);
+	if (pos > 0)
+		return true;
+
+	_body.close();
+	if (isMultipart() && _multipartState != PART_END)
 	{
-		setStatusCode(413);
+		setStatusCode(400);
 		setState(ERROR);
-		_body.close();
 		return false;
 	}
-	if (getHeader("content-type").find("multipart/form-data") != std::string::npos)
-	{
-		std::string chunk_part = data.substr(0, _chunkSize);
-		parseMultipartBody(chunk_part);
-	}
-	else 
-		_body.write(data.c_str(), _chunkSize);
-
-	data.erase(0, _chunkSize + 2);
-	_chunkState = CHUNK_SIZE;
-	return true;
+	setState(FINISH);
+	return false;
 }
 
 
@@ -609,7 +706,45 @@ void HTTPRequest::parseMultipartBody(std::string& data)
 			if (!processPartBoundary(data))
 				return;
 		} 
+		else
+			data.clear();
+	}
+}
+
+bool HTTPRequest::isMultipart() const
+{
+	return _boundary.size() > 2;
+}
+
+// only Content-Length bytes belong to the body, the epilogue after the closing boundary included
+void HTTPRequest::readMultipartBody(std::string& data) 
+{
+	size_t length = std::min(data.size(), _contentLength - _length);
+
+	_bodyBuffer.append(data, 0, length);
+	data.erase(0, length);
+	_length += length;
+	parseMultipartBody(_bodyBuffer);
+	if (_state == ERROR || _length < _contentLength)
+		return;
+	if (_multipartState != PART_END)
+	{
+		setStatusCode(400);
+		setState(ERROR);
+		return;
 	}
+	setState(FINISH);
+}
+
+// a body the location does not store is still read off the connection so the next request starts in sync
+void HTTPRequest::discardBody(std::string& data) 
+{
+	size_t length = std::min(data.size(), _contentLength - _length);
+
+	data.erase(0, length);
+	_length += length;
+	if (_length >= _contentLength)
+		setState(FINISH);
 }
 
 bool HTTPRequest::processPartHeader(std::string& data) 
@@ -630,7 +765,7 @@ bool HTTPRequest::processPartHeader(std::string& data)
 		return false;
 	std::string filename = headers.substr(filename_pos, quote_end - filename_pos);
 
-	std::string filePath = Utils::createUploadFile(filename, _location.getUploadPath());
+	std::string filePath = Utils::createUploadFile(filename, _location->getUploadPath());
 	_uploadFile.open(filePath.c_str(), std::ios::binary);
 	if (!_uploadFile.is_open()) 
 	{
@@ -647,14 +782,6 @@ bool HTTPRequest::processPartData(std::string& data)
 	size_t boundary_pos = data.find(_boundary);
 	if (boundary_pos == std::string::npos) 
 	{
-		if (getHeader("transfer-encoding") == "chunked")
-		{
-			_uploadFile.write(data.c_str(), data.size());
-			data.erase(0, data.size());
-			_state = CHUNKED;
-			return false;
-		}
-
 		if (data.size() <= _boundary.size() + 4)
 			return false;
 		size_t write_len = data.size() - (_boundary.size() + 4);
@@ -685,9 +812,8 @@ bool HTTPRequest::processPartBoundary(std::string& data)
 	{
 		data.erase(0, 2);
 		_multipartState = PART_END;
-		setState(FINISH);
 		setStatusCode(201);
-		return false;
+		return true;
 	}
 	else if (data.substr(0, 2) == "\r\n") 
 	{
@@ -698,6 +824,56 @@ bool HTTPRequest::processPartBoundary(std::string& data)
 	return false;
 }
 
+bool HTTPRequest::validateRateLimit()
+{
+	const LimitReq& rule = _location->getLimitReq().isEnabled() ? _location->getLimitReq() : _server->getLimitReq();
+
+	if (!_limiter || !rule.isEnabled() || _limiter->admitRequest(_peer, rule))
+		return true;
+	LOG_DEBUG("Request rate limit exceeded for " + _peer.toString());
+	setStatusCode(429);
+	setState(ERROR);
+	return false;
+}
+
+bool HTTPRequest::validateQuota()
+{
+	if (!acquireQuota(VhostQuota::CONNECTIONS, 1))
+		return false;
+	_quotaServer = _server;
+	return true;
+}
+
+bool HTTPRequest::acquireQuota(VhostQuota::Resource resource, size_t amount)
+{
+	if (!_quota || _quota->acquire(_server, resource, amount))
+	{
+		if (resource == VhostQuota::CGI)
+			_quotaCgi = true;
+		else if (resource == VhostQuota::BODY_BYTES)
+			_quotaBody += amount;
+		return true;
+	}
+	setStatusCode(503);
+	setState(ERROR);
+	return false;
+}
+
+void HTTPRequest::releaseQuota()
+{
+	if (_quota && _quotaServer)
+	{
+		_quota->release(_quotaServer, VhostQuota::CONNECTIONS, 1);
+		if (_quotaCgi)
+			_quota->release(_quotaServer, VhostQuota::CGI, 1);
+		if (_quotaBody)
+			_quota->release(_quotaServer, VhostQuota::BODY_BYTES, _quotaBody);
+	}
+	_quotaServer = NULL;
+	_quotaCgi = false;
+	_quotaBody = 0;
+}
+
 bool HTTPRequest::validateHostHeader() 
 {
 	std::string host = getHeader("host");
@@ -709,9 +885,9 @@ bool HTTPRequest::validateHostHeader()
 		return false;
 	}
 
-	_server = findServerByHost(host);
-	_location = _server.findLocation(_path);
-	_resource = _location.getResource(_path);
+	_server = &findServerByHost(host);
+	_location = &_server->findLocation(_path);
+	_resource = _location->getResource(_path);
 	if (_resource.empty())
 	{
 		setState(ERROR);
@@ -722,7 +898,13 @@ bool HTTPRequest::validateHostHeader()
 	std::string hostname;
 	std::string port;
 
-	size_t colonPos = host.find(':');
+	size_t colonPos = host.find(':', host[0] == '[' ? host.find(']') : 0);
+	if (host[0] == '[' && (host.find(']') == std::string::npos || (colonPos == std::string::npos && host[host.size() - 1] != ']')))
+	{
+		setStatusCode(400);
+		setState(ERROR);
+		return false;
+	}
 	if (colonPos != std::string::npos) 
 	{
 		hostname = host.substr(0, colonPos);
@@ -768,13 +950,15 @@ bool HTTPRequest::validateContentLength()
 		}
 	}
 	_contentLength = Utils::stringToSizeT(cl);
-	if (_contentLength > _server.getClientMaxBodySize()) 
+	if (_contentLength > _server->getClientMaxBodySize()) 
 	{
 		setStatusCode(413);
 		setState(ERROR);
 		return false;
 	}
-	setState(FINISH);
+	if (_contentLength > 0 && !acquireQuota(VhostQuota::BODY_BYTES, _contentLength))
+		return false;
+	setState(_contentLength > 0 ? DISCARD : FINISH);
 	return true;
 }
 
@@ -805,7 +989,7 @@ bool HTTPRequest::validateTransferEncoding()
 
 bool HTTPRequest::validateMultipartFormData() 
 {
-	if (_location.hasCgi())
+	if (_location->hasCgi())
 		return true;
 
 	std::string ct = getHeader("content-type");
@@ -827,7 +1011,7 @@ bool HTTPRequest::validateMultipartFormData()
 
 bool HTTPRequest::validateAllowedMethods() 
 {
-	if (_location.isMethodAllowed(_method))
+	if (_location->isMethodAllowed(_method))
 		return true;
 	setState(ERROR);
 	setStatusCode(405);
@@ -836,6 +1020,7 @@ bool HTTPRequest::validateAllowedMethods()
 
 void HTTPRequest::clear() 
 {
+	releaseQuota();
 	if (_uploadFile.is_open())
 		_uploadFile.close();
 	if (_body.is_open())
@@ -847,6 +1032,7 @@ void HTTPRequest::clear()
 	_statusCode = 200;
 	_state = INIT;
 	_parsePosition = 0;
+	_headerSize = 0;
 	_contentLength = 0;
 	_method = "GET";
 	_uri = "/";
@@ -863,6 +1049,12 @@ void HTTPRequest::clear()
 	_boundary = "--";
 	_multipartState = PART_HEADER;
 	_chunkState = CHUNK_SIZE;
+	_length = 0;
+	_totalBodySize = 0;
+	_resource = "";
+	_bodyFile = "";
+	_server = _servers ? &(*_servers)[0] : NULL;
+	_location = &noLocation();
 	_client_fd = -1;
 
 }
@@ -28,10 +28,13 @@ HTTPResponse::HTTPResponse(HTTPRequest* request)
 	_filePath(""),
 	_fileSize(0),
 	_cgiRuning(false),
+	_hasCgiOutput(false),
+	_cgiHeaderComplete(false),
 	_bytesSent(0),
 	_headerSent(false),
 	_isComplete(false),
-	_isReady(false)
+	_isReady(false),
+	_keepAliveAllowed(true)
 {
 }
 
@@ -50,6 +53,11 @@ bool HTTPResponse::isComplete()
 	return (_isComplete);
 }
 
+bool HTTPResponse::hasPendingData() const
+{
+	return _bytesSent < _header.size() + getContentLength();
+}
+
 bool HTTPResponse::isReady()
 {
 	if (_request->hasCgi())
@@ -60,6 +68,15 @@ bool HTTPResponse::isReady()
 }
 void HTTPResponse::clear() 
 {
+	if (_fileStream.is_open())
+		_fileStream.close();
+	if (_cgiOutput.is_open())
+	{
+		_cgiOutput.close();
+		std::remove(_cgiFile.c_str());
+	}
+	_cgiHandler.killProcess();
+
 	_protocol      = "HTTP/1.1";
 	_statusCode    = 200;
 	_statusMessage = "OK";
@@ -73,13 +90,28 @@ void HTTPResponse::clear()
 	_cgiRuning    = false;
 	_isComplete    = false;
 	_isReady     =  false;
+	_keepAliveAllowed = true;
 
 	_hasCgiOutput = false;
 	_cgiHeaderComplete = false;
+	_cgiHeaderBuffer.clear();
 	_cgiHandler.cleanup();
 }
 
-ssize_t HTTPResponse::getResponseChunk(char* buffer)
+// the body source is closed as soon as the last byte is out, not on the next call
+void HTTPResponse::finish()
+{
+	if (_fileStream.is_open())
+		_fileStream.close();
+	if (_cgiOutput.is_open())
+	{
+		_cgiOutput.close();
+		std::remove(_cgiFile.c_str());
+	}
+	_isComplete = true;
+}
+
+ssize_t HTTPResponse::getResponseChunk(char* buffer, size_t size)
 {
 	if (!buffer)
 		return -1;
@@ -87,47 +119,41 @@ ssize_t HTTPResponse::getResponseChunk(char* buffer)
 	size_t totalResponseSize = _header.size() + getContentLength();
 
 	if (_bytesSent >= totalResponseSize)
-	{
-		if (_fileStream.is_open())
-			_fileStream.close();
-		if (_cgiOutput.is_open())
-		{
-			_cgiOutput.close();
-			std::remove(_cgiFile.c_str());
-		}
-
-		return (_isComplete = true, 0);
-	}
+		return (finish(), 0);
 
 	else if (!_headerSent || _bytesSent < _header.size())
-		return getHeaderChunk(buffer);
+		return getHeaderChunk(buffer, size);
 	else if (!_body.empty() || !_filePath.empty())
-		return getContentChunk(buffer);
+		return getContentChunk(buffer, size);
 
 	return 1;
 
 }
 
-ssize_t HTTPResponse::getHeaderChunk(char* buffer)
+ssize_t HTTPResponse::getHeaderChunk(char* buffer, size_t size)
 {
-	
-	std::memcpy(buffer, _header.c_str(), _header.size());
-	_bytesSent += _header.size();
-	_headerSent = true;
+	size_t length = std::min(size, _header.size() - _bytesSent);
+
+	std::memcpy(buffer, _header.data() + _bytesSent, length);
+	_bytesSent += length;
+	_headerSent = (_bytesSent == _header.size());
 
-	return _header.size();
+	return length;
 }
 
 
 
-ssize_t HTTPResponse::getContentChunk(char* buffer)
+ssize_t HTTPResponse::getContentChunk(char* buffer, size_t size)
 {
 	
 	if (!_body.empty())
 	{
-		std::memcpy(buffer, _body.c_str(), _body.size());
-		_bytesSent += _body.size();
-		return _body.size();
+		size_t offset = _bytesSent - _header.size();
+		size_t length = std::min(size, _body.size() - offset);
+
+		std::memcpy(buffer, _body.data() + offset, length);
+		_bytesSent += length;
+		return length;
 	}
 
 	else if (!_filePath.empty())
@@ -139,7 +165,7 @@ ssize_t HTTPResponse::getContentChunk(char* buffer)
 				return -1;
 		}
 
-		_fileStream.read(buffer, BUFFER_SIZE);
+		_fileStream.read(buffer, size);
 		ssize_t bytesRead = _fileStream.gcount();
 
 		if (bytesRead > 0)
@@ -160,13 +186,6 @@ bool HTTPResponse::isCgiRuning()
 	if (_cgiHandler.getPid() <= 0)
 		return false;
 
-	if (_cgiHandler.hasTimedOut())
-	{
-		LOG_DEBUG("CGI process timed out");
-		_cgiHandler.killProcess();
-		buildErrorResponse(504);
-		return false;
-	}
 	int status;
 	if (_cgiHandler.isRunning(status))
 		return true;
@@ -188,6 +207,13 @@ bool HTTPResponse::isCgiRuning()
 }
 
 
+void HTTPResponse::abortCgi()
+{
+	LOG_DEBUG("CGI process timed out");
+	_cgiHandler.killProcess();
+	buildErrorResponse(504);
+}
+
 CGIHandler& HTTPResponse::getCgiHandler()
 {
 	return _cgiHandler;
@@ -217,15 +243,18 @@ void HTTPResponse::readCgiFileAndParse(const std::string& filepath)
 	std::ifstream file(filepath.c_str(), std::ios::binary);
 	if (!file.is_open())
 		throw std::runtime_error("Can't open CGI output file: " + filepath);
-	std::string buffer;
+	char buffer[READ_BUFFER_SIZE];
+	std::string chunk;
 	while (!file.eof())
 	{
-		buffer.resize(BUFFER_SIZE);
-		file.read(&buffer[0], BUFFER_SIZE);
+		file.read(buffer, sizeof(buffer));
 		size_t bytesRead = file.gcount();
 
 		if (bytesRead > 0)
-			parseCgiResponse(buffer.substr(0, bytesRead));
+		{
+			chunk.assign(buffer, bytesRead);
+			parseCgiResponse(chunk);
+		}
 	}
 
 	file.close();
@@ -302,6 +331,23 @@ std::string HTTPResponse::getHeader() const
 	return _header;
 }
 
+const std::map<std::string, std::string>& HTTPResponse::getHeaders() const
+{
+	return _headers;
+}
+
+int HTTPResponse::getStatusCode() const
+{
+	return _statusCode;
+}
+
+// HTTP/2 sends the header fields in its own frame, only the body goes through getResponseChunk()
+void HTTPResponse::skipHeader()
+{
+	_bytesSent = _header.size();
+	_headerSent = true;
+}
+
 std::string HTTPResponse::getBody() const 
 {
 	return _body;
@@ -322,11 +368,18 @@ size_t HTTPResponse::getFileSize() const
 	return _fileSize;
 }
 
+void HTTPResponse::disableKeepAlive()
+{
+	_keepAliveAllowed = false;
+}
+
 bool HTTPResponse::shouldKeepAlive() const 
 {
 	int reqStatus = _request->getStatusCode();
 	std::string connection = Utils::trim(_request->getHeader("connection"));
 
+	if (!_keepAliveAllowed || _request->hasUnreadBody())
+		return false;
 	if (connection == "close")
 		return false;
 	else if (connection == "keep-alive")
@@ -386,6 +439,23 @@ void HTTPResponse::buildErrorResponse(int statusCode)
 	_isReady = true;
 }
 
+// refusals are written to the socket before any request is read, so a listener builds them once
+std::string HTTPResponse::buildRejection(const ServerConfig& server, int statusCode)
+{
+	std::string body = server.getErrorPage(statusCode);
+	std::string response = "HTTP/1.1 " + Utils::toString(statusCode) + " " + Utils::getMessage(statusCode) + "\r\n";
+
+	if (Utils::isFileExists(body))
+		body = Utils::readFileContent(body);
+	response += "Server: 1337webserver\r\n";
+	if (statusCode == 503)
+		response += "Retry-After: " + Utils::toString(OVERLOAD_RETRY_AFTER) + "\r\n";
+	response += "Content-Type: text/html\r\n";
+	response += "Content-Length: " + Utils::toString(body.size()) + "\r\n";
+	response += "Connection: close\r\n\r\n";
+	return response + body;
+}
+
 void HTTPResponse::buildSuccessResponse(const std::string& fullPath) 
 {
 	setProtocol(_request->getProtocol());
@@ -476,7 +546,7 @@ void HTTPResponse::handleDelete()
 
 void HTTPResponse::handleRedirect()
 {
-	const LocationConfig location = _request->getLocation();
+	const LocationConfig& location = _request->getLocation();
 
 	int code = location.getRedirectCode();
 	std::string reason = Utils::getMessage(code);
@@ -549,8 +619,7 @@ void HTTPResponse::handleAutoIndex()
 
 void HTTPResponse::parseCgiResponse(const std::string& chunk)
 {
-
-	static std::string headerBuffer;
+	std::string& headerBuffer = _cgiHeaderBuffer;
 
 	if (_cgiHeaderComplete) 
 		return (writeToFile(chunk));
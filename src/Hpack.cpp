@@ -0,0 +1,291 @@
+#include "../include/Hpack.hpp"
+#include "../include/ServerConfig.hpp"
+#include "../include/Utils.hpp"
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_MAX_BITS 30
+
+static const char* const staticTable[][2] =
+{
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+	{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+	{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+	{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+	{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" }
+};
+
+static const size_t staticTableSize = sizeof(staticTable) / sizeof(staticTable[0]);
+
+// the HPACK Huffman code is canonical, so the code length of every symbol is enough to rebuild it
+static const unsigned char huffmanLengths[HUFFMAN_SYMBOLS] =
+{
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+// codes of one length are consecutive, starting at first[length]
+struct HuffmanTable
+{
+	unsigned int    first[HUFFMAN_MAX_BITS + 1];
+	unsigned int    count[HUFFMAN_MAX_BITS + 1];
+	unsigned int    offset[HUFFMAN_MAX_BITS + 1];
+	unsigned short  symbols[HUFFMAN_SYMBOLS];
+
+	HuffmanTable();
+};
+
+HuffmanTable::HuffmanTable()
+{
+	unsigned int code = 0;
+	unsigned int index = 0;
+
+	for (int bits = 0; bits <= HUFFMAN_MAX_BITS; ++bits)
+	{
+		first[bits] = code;
+		offset[bits] = index;
+		count[bits] = 0;
+		for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; ++symbol)
+			if (huffmanLengths[symbol] == bits)
+				symbols[index + count[bits]++] = symbol;
+		index += count[bits];
+		code = (code + count[bits]) << 1;
+	}
+}
+
+static const HuffmanTable huffman;
+
+Hpack::Hpack() : _tableSize(0), _maxTableSize(H2_HEADER_TABLE_SIZE)
+{
+}
+
+Hpack::~Hpack()
+{
+}
+
+bool Hpack::decode(const std::string& block, HeaderList& headers, size_t maxSize)
+{
+	size_t pos = 0;
+	size_t size = 0;
+
+	while (pos < block.size())
+	{
+		unsigned char type = block[pos];
+		Header header;
+		size_t index;
+
+		if (type & 0x80)
+		{
+			if (!decodeInteger(block, pos, 7, index) || !lookup(index, header))
+				return false;
+		}
+		else if ((type & 0xe0) == 0x20)
+		{
+			if (!decodeInteger(block, pos, 5, index) || index > H2_HEADER_TABLE_SIZE)
+				return false;
+			_maxTableSize = index;
+			evict(0);
+			continue;
+		}
+		else
+		{
+			// 01 adds the field to the dynamic table, 0000 and 0001 leave it out
+			bool indexing = type & 0x40;
+			if (!decodeInteger(block, pos, indexing ? 6 : 4, index))
+				return false;
+			if (index == 0 ? !decodeString(block, pos, header.first) : !lookup(index, header))
+				return false;
+			if (!decodeString(block, pos, header.second))
+				return false;
+			if (indexing)
+				insert(header);
+		}
+
+		// a few bytes of indexed fields can name kilobytes of table entries
+		size += header.first.size() + header.second.size() + HPACK_ENTRY_OVERHEAD;
+		if (size > maxSize)
+			return false;
+		headers.push_back(header);
+	}
+	return true;
+}
+
+bool Hpack::lookup(size_t index, Header& header) const
+{
+	if (index == 0)
+		return false;
+	if (index <= staticTableSize)
+	{
+		header.first = staticTable[index - 1][0];
+		header.second = staticTable[index - 1][1];
+		return true;
+	}
+	index -= staticTableSize + 1;
+	if (index >= _table.size())
+		return false;
+	header = _table[index];
+	return true;
+}
+
+void Hpack::insert(const Header& header)
+{
+	size_t size = header.first.size() + header.second.size() + HPACK_ENTRY_OVERHEAD;
+
+	// an entry larger than the whole table just empties it
+	evict(size);
+	if (size > _maxTableSize)
+		return;
+	_table.push_front(header);
+	_tableSize += size;
+}
+
+void Hpack::evict(size_t needed)
+{
+	while (!_table.empty() && _tableSize + needed > _maxTableSize)
+	{
+		_tableSize -= _table.back().first.size() + _table.back().second.size() + HPACK_ENTRY_OVERHEAD;
+		_table.pop_back();
+	}
+}
+
+bool Hpack::decodeInteger(const std::string& block, size_t& pos, int prefix, size_t& value)
+{
+	size_t mask = (1 << prefix) - 1;
+
+	if (pos >= block.size())
+		return false;
+	value = static_cast<unsigned char>(block[pos++]) & mask;
+	if (value < mask)
+		return true;
+	for (int shift = 0; pos < block.size() && shift <= 28; shift += 7)
+	{
+		unsigned char byte = block[pos++];
+		value += static_cast<size_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool Hpack::decodeString(const std::string& block, size_t& pos, std::string& value)
+{
+	size_t length;
+
+	if (pos >= block.size())
+		return false;
+	bool encoded = block[pos] & 0x80;
+	if (!decodeInteger(block, pos, 7, length) || length > block.size() - pos)
+		return false;
+	value.clear();
+	if (encoded && !decodeHuffman(reinterpret_cast<const unsigned char*>(block.data()) + pos, length, value))
+		return false;
+	if (!encoded)
+		value.assign(block, pos, length);
+	pos += length;
+	return true;
+}
+
+bool Hpack::decodeHuffman(const unsigned char* data, size_t length, std::string& out)
+{
+	unsigned int code = 0;
+	int bits = 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		for (int shift = 7; shift >= 0; --shift)
+		{
+			code = (code << 1) | ((data[i] >> shift) & 1);
+			if (++bits > HUFFMAN_MAX_BITS)
+				return false;
+			if (code - huffman.first[bits] >= huffman.count[bits])
+				continue;
+			unsigned short symbol = huffman.symbols[huffman.offset[bits] + code - huffman.first[bits]];
+			if (symbol == HUFFMAN_SYMBOLS - 1)
+				return false;
+			out += static_cast<char>(symbol);
+			code = 0;
+			bits = 0;
+		}
+	}
+	// padding is a prefix of the all-ones EOS code, shorter than a byte
+	return bits < 8 && code == (1u << bits) - 1;
+}
+
+void Hpack::encodeInteger(size_t value, int prefix, unsigned char flags, std::string& out)
+{
+	size_t mask = (1 << prefix) - 1;
+
+	if (value < mask)
+	{
+		out += static_cast<char>(flags | value);
+		return;
+	}
+	out += static_cast<char>(flags | mask);
+	for (value -= mask; value >= 0x80; value >>= 7)
+		out += static_cast<char>((value & 0x7f) | 0x80);
+	out += static_cast<char>(value);
+}
+
+size_t Hpack::findName(const std::string& name)
+{
+	for (size_t i = 0; i < staticTableSize; ++i)
+		if (name == staticTable[i][0])
+			return i + 1;
+	return 0;
+}
+
+// literal without indexing, so the peer's table settings never matter
+void Hpack::encode(const std::string& name, const std::string& value, std::string& out)
+{
+	size_t index = findName(name);
+
+	encodeInteger(index, 4, 0x00, out);
+	if (index == 0)
+	{
+		encodeInteger(name.size(), 7, 0x00, out);
+		out += name;
+	}
+	encodeInteger(value.size(), 7, 0x00, out);
+	out += value;
+}
+
+void Hpack::encodeStatus(int status, std::string& out)
+{
+	std::string code = Utils::toString(status);
+
+	for (size_t i = 0; i < staticTableSize; ++i)
+	{
+		if (code == staticTable[i][1] && std::string(staticTable[i][0]) == ":status")
+		{
+			encodeInteger(i + 1, 7, 0x80, out);
+			return;
+		}
+	}
+	encode(":status", code, out);
+}
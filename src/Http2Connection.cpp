@@ -0,0 +1,905 @@
+#include "../include/Http2Connection.hpp"
+#include "../include/Logger.hpp"
+#include "../include/Utils.hpp"
+#include <algorithm>
+#include <sstream>
+#include <cctype>
+#include <cstring>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_SIZE 24
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+static uint32_t read32(const char* data)
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+	return (static_cast<uint32_t>(bytes[0]) << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static std::string encode32(uint32_t value)
+{
+	std::string out(4, '\0');
+
+	out[0] = static_cast<char>(value >> 24);
+	out[1] = static_cast<char>(value >> 16);
+	out[2] = static_cast<char>(value >> 8);
+	out[3] = static_cast<char>(value);
+	return out;
+}
+
+static void appendSetting(std::string& out, int id, uint32_t value)
+{
+	out += static_cast<char>(id >> 8);
+	out += static_cast<char>(id);
+	out += encode32(value);
+}
+
+static bool hasToken(const std::string& value, const std::string& token)
+{
+	std::vector<std::string> tokens = Utils::split(value, ',');
+
+	for (size_t i = 0; i < tokens.size(); ++i)
+	{
+		std::string current = tokens[i];
+		for (size_t j = 0; j < current.size(); ++j)
+			current[j] = std::tolower(current[j]);
+		if (current == token)
+			return true;
+	}
+	return false;
+}
+
+// HTTP2-Settings is base64url without padding
+static bool decodeBase64Url(const std::string& text, std::string& out)
+{
+	uint32_t bits = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < text.size() && text[i] != '='; ++i)
+	{
+		char c = text[i];
+		int value;
+
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			value = 62;
+		else if (c == '_' || c == '/')
+			value = 63;
+		else
+			return false;
+		bits = (bits << 6) | value;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			out += static_cast<char>((bits >> count) & 0xff);
+		}
+	}
+	return true;
+}
+
+// fields that only mean something to a single HTTP/1.1 hop
+static bool isConnectionHeader(const std::string& name)
+{
+	return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+		|| name == "transfer-encoding" || name == "upgrade";
+}
+
+Http2Connection::Stream::Stream(uint32_t streamId, HTTPRequest* streamRequest, HTTPResponse* streamResponse, bool ownsRequest)
+	: id(streamId),
+	request(streamRequest),
+	response(streamResponse),
+	owned(ownsRequest),
+	sendWindow(DEFAULT_WINDOW),
+	recvWindow(H2_WINDOW_SIZE),
+	chunked(false),
+	remoteClosed(false),
+	started(false),
+	headersSent(false)
+{
+}
+
+Http2Connection::Http2Connection(int fd, const PeerAddress& peer, ServerSet* serverSet, RateLimiter* limiter)
+	: _fd(fd),
+	_peer(peer),
+	_serverSet(serverSet),
+	_limiter(limiter),
+	_outputOffset(0),
+	_headerStream(0),
+	_headerEndStream(false),
+	_lastStream(0),
+	_cursor(0),
+	_sendWindow(DEFAULT_WINDOW),
+	_recvWindow(H2_WINDOW_SIZE),
+	_initialWindow(DEFAULT_WINDOW),
+	_maxFrameSize(H2_FRAME_SIZE),
+	_requests(0),
+	_keepaliveTimeout(TIMEOUT),
+	_prefaceReceived(false),
+	_goawaySent(false),
+	_goawayReceived(false),
+	_failed(false),
+	_waiting(false)
+{
+	std::string settings;
+
+	appendSetting(settings, SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS);
+	appendSetting(settings, SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW_SIZE);
+	appendSetting(settings, SETTINGS_MAX_HEADER_LIST_SIZE, READ_HIGH_WATERMARK);
+	queueFrame(SETTINGS, 0, 0, settings);
+	// SETTINGS only covers streams, the connection window grows through WINDOW_UPDATE
+	queueFrame(WINDOW_UPDATE, 0, 0, encode32(H2_WINDOW_SIZE - DEFAULT_WINDOW));
+}
+
+// the ServerSet may already be gone here, streams release their quota in closeStreams()
+Http2Connection::~Http2Connection()
+{
+	for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+	{
+		if (it->second->owned)
+		{
+			delete it->second->response;
+			delete it->second->request;
+		}
+		delete it->second;
+	}
+}
+
+bool Http2Connection::matchesPreface(const std::string& data)
+{
+	size_t length = std::min(data.size(), static_cast<size_t>(PREFACE_SIZE));
+
+	return data.compare(0, length, PREFACE, length) == 0;
+}
+
+bool Http2Connection::hasPreface(const std::string& data)
+{
+	return data.size() >= PREFACE_SIZE && matchesPreface(data);
+}
+
+// h2c upgrade, the HTTP/1.1 request that asked for it is answered on stream 1
+bool Http2Connection::upgrade(HTTPRequest* request, HTTPResponse* response)
+{
+	std::string settings;
+
+	if (!hasToken(request->getHeader("upgrade"), "h2c") || !hasToken(request->getHeader("connection"), "upgrade"))
+		return false;
+	if (!request->getHeaders().count("http2-settings") || !decodeBase64Url(request->getHeader("http2-settings"), settings))
+		return false;
+	if (settings.size() % 6 != 0 || applySettings(settings.data(), settings.size()) != NO_ERROR)
+		return false;
+
+	_output.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	Stream* stream = new Stream(1, request, response, false);
+	stream->sendWindow = _initialWindow;
+	stream->remoteClosed = true;
+	_streams[1] = stream;
+	_lastStream = 1;
+	LOG_DEBUG("HTTP/2 upgrade on fd " + Utils::toString(_fd));
+	return true;
+}
+
+void Http2Connection::consume(std::string& input)
+{
+	size_t offset = 0;
+
+	if (!_prefaceReceived && !_failed)
+	{
+		if (!matchesPreface(input))
+			connectionError(PROTOCOL_ERROR, "invalid connection preface");
+		else if (!hasPreface(input))
+			return;
+		else
+		{
+			offset = PREFACE_SIZE;
+			_prefaceReceived = true;
+		}
+	}
+	while (!_failed && input.size() - offset >= FRAME_HEADER_SIZE)
+	{
+		const unsigned char* header = reinterpret_cast<const unsigned char*>(input.data() + offset);
+		size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+
+		if (length > H2_FRAME_SIZE)
+		{
+			connectionError(FRAME_SIZE_ERROR, "frame of " + Utils::toString(length) + " bytes");
+			break;
+		}
+		if (input.size() - offset < FRAME_HEADER_SIZE + length)
+			break;
+		uint32_t id = read32(input.data() + offset + 5) & MAX_WINDOW;
+		handleFrame(header[3], header[4], id, input.data() + offset + FRAME_HEADER_SIZE, length);
+		offset += FRAME_HEADER_SIZE + length;
+	}
+	if (_failed)
+		input.clear();
+	else
+		input.erase(0, offset);
+}
+
+void Http2Connection::handleFrame(int type, int flags, uint32_t id, const char* payload, size_t length)
+{
+	// nothing may come between the frames of one header block
+	if (_headerStream && (type != CONTINUATION || id != _headerStream))
+		return connectionError(PROTOCOL_ERROR, "header block interrupted");
+
+	switch (type)
+	{
+		case DATA:
+			return handleData(flags, id, payload, length);
+		case HEADERS:
+			return handleHeaders(flags, id, payload, length);
+		case PRIORITY:
+			if (id == 0)
+				return connectionError(PROTOCOL_ERROR, "PRIORITY on stream 0");
+			if (length != 5)
+				resetStream(id, FRAME_SIZE_ERROR);
+			return;
+		case RST_STREAM:
+			return handleRstStream(id, length);
+		case SETTINGS:
+			return handleSettings(flags, id, payload, length);
+		case PUSH_PROMISE:
+			return connectionError(PROTOCOL_ERROR, "PUSH_PROMISE from client");
+		case PING:
+			return handlePing(flags, id, payload, length);
+		case GOAWAY:
+			return handleGoaway(id, payload, length);
+		case WINDOW_UPDATE:
+			return handleWindowUpdate(id, payload, length);
+		case CONTINUATION:
+			if (!_headerStream)
+				return connectionError(PROTOCOL_ERROR, "unexpected CONTINUATION");
+			return handleContinuation(flags, payload, length);
+		default:
+			return;
+	}
+}
+
+void Http2Connection::handleData(int flags, uint32_t id, const char* payload, size_t length)
+{
+	if (id == 0 || id > _lastStream)
+		return connectionError(PROTOCOL_ERROR, "DATA on idle stream " + Utils::toString(id));
+	if (static_cast<int64_t>(length) > _recvWindow)
+		return connectionError(FLOW_CONTROL_ERROR, "connection window exceeded");
+	_recvWindow -= length;
+
+	const char* data = payload;
+	size_t size = length;
+	if (!stripPadding(flags, data, size))
+		return connectionError(PROTOCOL_ERROR, "invalid padding");
+
+	std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+	Stream* stream = it == _streams.end() ? NULL : it->second;
+	if (stream && stream->remoteClosed)
+	{
+		resetStream(id, STREAM_CLOSED);
+		stream = NULL;
+	}
+	else if (stream && static_cast<int64_t>(length) > stream->recvWindow)
+	{
+		resetStream(id, FLOW_CONTROL_ERROR);
+		stream = NULL;
+	}
+	else if (stream)
+	{
+		stream->recvWindow -= length;
+		receiveBody(stream, data, size, flags & FLAG_END_STREAM);
+	}
+	updateWindows(stream);
+}
+
+void Http2Connection::handleHeaders(int flags, uint32_t id, const char* payload, size_t length)
+{
+	if (id == 0)
+		return connectionError(PROTOCOL_ERROR, "HEADERS on stream 0");
+	if (!stripPadding(flags, payload, length))
+		return connectionError(PROTOCOL_ERROR, "invalid padding");
+	// priorities are not used, the scheduler is round-robin
+	if (flags & FLAG_PRIORITY)
+	{
+		if (length < 5)
+			return connectionError(FRAME_SIZE_ERROR, "short HEADERS priority");
+		payload += 5;
+		length -= 5;
+	}
+	_headerStream = id;
+	_headerEndStream = flags & FLAG_END_STREAM;
+	_headerBlock.assign(payload, length);
+	if (flags & FLAG_END_HEADERS)
+		endHeaders();
+}
+
+void Http2Connection::handleContinuation(int flags, const char* payload, size_t length)
+{
+	if (_headerBlock.size() + length > READ_HIGH_WATERMARK)
+		return connectionError(ENHANCE_YOUR_CALM, "header block too large");
+	_headerBlock.append(payload, length);
+	if (flags & FLAG_END_HEADERS)
+		endHeaders();
+}
+
+void Http2Connection::handleSettings(int flags, uint32_t id, const char* payload, size_t length)
+{
+	if (id != 0)
+		return connectionError(PROTOCOL_ERROR, "SETTINGS on a stream");
+	if (flags & FLAG_ACK)
+	{
+		if (length != 0)
+			connectionError(FRAME_SIZE_ERROR, "SETTINGS ack with payload");
+		return;
+	}
+	if (length % 6 != 0)
+		return connectionError(FRAME_SIZE_ERROR, "SETTINGS length");
+
+	ErrorCode code = applySettings(payload, length);
+	if (code != NO_ERROR)
+		return connectionError(code, "invalid SETTINGS");
+	queueFrame(SETTINGS, FLAG_ACK, 0, "");
+}
+
+Http2Connection::ErrorCode Http2Connection::applySettings(const char* payload, size_t length)
+{
+	for (size_t i = 0; i + 6 <= length; i += 6)
+	{
+		int id = (static_cast<unsigned char>(payload[i]) << 8) | static_cast<unsigned char>(payload[i + 1]);
+		uint32_t value = read32(payload + i + 2);
+
+		if (id == SETTINGS_ENABLE_PUSH && value > 1)
+			return PROTOCOL_ERROR;
+		if (id == SETTINGS_INITIAL_WINDOW_SIZE)
+		{
+			if (value > MAX_WINDOW)
+				return FLOW_CONTROL_ERROR;
+			// the difference applies to every open stream, even into a negative window
+			for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+			{
+				it->second->sendWindow += static_cast<int64_t>(value) - _initialWindow;
+				if (it->second->sendWindow > MAX_WINDOW)
+					return FLOW_CONTROL_ERROR;
+			}
+			_initialWindow = value;
+		}
+		if (id == SETTINGS_MAX_FRAME_SIZE)
+		{
+			if (value < H2_FRAME_SIZE || value > 0xffffff)
+				return PROTOCOL_ERROR;
+			_maxFrameSize = value;
+		}
+	}
+	return NO_ERROR;
+}
+
+void Http2Connection::handlePing(int flags, uint32_t id, const char* payload, size_t length)
+{
+	if (id != 0)
+		return connectionError(PROTOCOL_ERROR, "PING on a stream");
+	if (length != 8)
+		return connectionError(FRAME_SIZE_ERROR, "PING length");
+	if (!(flags & FLAG_ACK))
+		queueFrame(PING, FLAG_ACK, 0, std::string(payload, length));
+}
+
+void Http2Connection::handleWindowUpdate(uint32_t id, const char* payload, size_t length)
+{
+	if (length != 4)
+		return connectionError(FRAME_SIZE_ERROR, "WINDOW_UPDATE length");
+
+	uint32_t increment = read32(payload) & MAX_WINDOW;
+	if (id == 0)
+	{
+		if (increment == 0)
+			return connectionError(PROTOCOL_ERROR, "zero window increment");
+		_sendWindow += increment;
+		if (_sendWindow > MAX_WINDOW)
+			connectionError(FLOW_CONTROL_ERROR, "connection window overflow");
+		return;
+	}
+	if (id > _lastStream)
+		return connectionError(PROTOCOL_ERROR, "WINDOW_UPDATE on idle stream " + Utils::toString(id));
+
+	std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+	if (it == _streams.end())
+		return;
+	if (increment == 0)
+		return resetStream(id, PROTOCOL_ERROR);
+	it->second->sendWindow += increment;
+	if (it->second->sendWindow > MAX_WINDOW)
+		resetStream(id, FLOW_CONTROL_ERROR);
+}
+
+void Http2Connection::handleRstStream(uint32_t id, size_t length)
+{
+	if (id == 0 || id > _lastStream)
+		return connectionError(PROTOCOL_ERROR, "RST_STREAM on idle stream " + Utils::toString(id));
+	if (length != 4)
+		return connectionError(FRAME_SIZE_ERROR, "RST_STREAM length");
+	closeStream(id);
+}
+
+void Http2Connection::handleGoaway(uint32_t id, const char* payload, size_t length)
+{
+	if (id != 0)
+		return connectionError(PROTOCOL_ERROR, "GOAWAY on a stream");
+	if (length < 8)
+		return connectionError(FRAME_SIZE_ERROR, "GOAWAY length");
+	_goawayReceived = true;
+	LOG_DEBUG("GOAWAY on fd " + Utils::toString(_fd) + ", error " + Utils::toString(read32(payload + 4)));
+}
+
+void Http2Connection::endHeaders()
+{
+	uint32_t id = _headerStream;
+	bool endStream = _headerEndStream;
+	Hpack::HeaderList headers;
+
+	_headerStream = 0;
+	// refused blocks are decoded as well, the dynamic table must stay in step with the client's
+	bool decoded = _decoder.decode(_headerBlock, headers, READ_HIGH_WATERMARK);
+	_headerBlock.clear();
+	if (!decoded)
+		return connectionError(COMPRESSION_ERROR, "invalid header block");
+
+	std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+	if (it != _streams.end())
+	{
+		// trailers only end the request body, their fields are dropped
+		if (it->second->remoteClosed)
+			return resetStream(id, STREAM_CLOSED);
+		if (!endStream)
+			return resetStream(id, PROTOCOL_ERROR);
+		return receiveBody(it->second, NULL, 0, true);
+	}
+	if (id <= _lastStream)
+		return;
+	if (!(id & 1))
+		return connectionError(PROTOCOL_ERROR, "even stream id " + Utils::toString(id));
+	_lastStream = id;
+	if (_goawaySent)
+		return;
+	if (_streams.size() >= H2_MAX_STREAMS)
+		return resetStream(id, REFUSED_STREAM);
+
+	std::string text;
+	bool chunked;
+	if (!buildRequest(headers, endStream, text, chunked))
+		return resetStream(id, PROTOCOL_ERROR);
+	openStream(id, text, chunked, endStream);
+}
+
+// HTTPRequest parses HTTP/1.1 text, so nothing may pass that would change its framing
+bool Http2Connection::buildRequest(const Hpack::HeaderList& headers, bool endStream, std::string& text, bool& chunked) const
+{
+	std::string method, scheme, path, authority, fields;
+	bool regular = false;
+	bool hasLength = false;
+
+	for (size_t i = 0; i < headers.size(); ++i)
+	{
+		const std::string& name = headers[i].first;
+		const std::string& value = headers[i].second;
+
+		if (name.empty() || value.find_first_of(std::string("\r\n\0", 3)) != std::string::npos)
+			return false;
+		if (name[0] == ':')
+		{
+			std::string* field = NULL;
+			if (name == ":method")
+				field = &method;
+			else if (name == ":scheme")
+				field = &scheme;
+			else if (name == ":path")
+				field = &path;
+			else if (name == ":authority")
+				field = &authority;
+			if (regular || !field || !field->empty())
+				return false;
+			*field = value;
+			continue;
+		}
+		regular = true;
+		for (size_t j = 0; j < name.size(); ++j)
+		{
+			unsigned char c = name[j];
+			if (c <= 0x20 || c >= 0x7f || c == ':' || std::isupper(c))
+				return false;
+		}
+		if (isConnectionHeader(name) || (name == "te" && value != "trailers"))
+			return false;
+		if (name == "host" && !authority.empty())
+			continue;
+		if (name == "content-length")
+			hasLength = true;
+		fields += name + ": " + value + "\r\n";
+	}
+	if (method.empty() || scheme.empty() || path.empty())
+		return false;
+	for (size_t i = 0; i < method.size() + path.size(); ++i)
+	{
+		unsigned char c = i < method.size() ? method[i] : path[i - method.size()];
+		if (c <= 0x20 || c == 0x7f)
+			return false;
+	}
+
+	text = method + " " + path + " HTTP/1.1\r\n";
+	if (!authority.empty())
+		text += "host: " + authority + "\r\n";
+	text += fields;
+	// DATA frames without a declared length reach the parser as chunks
+	chunked = !endStream && !hasLength;
+	if (chunked)
+		text += "transfer-encoding: chunked\r\n";
+	text += "\r\n";
+	return true;
+}
+
+void Http2Connection::openStream(uint32_t id, const std::string& text, bool chunked, bool endStream)
+{
+	HTTPRequest* request = new HTTPRequest();
+	Stream* stream = new Stream(id, request, new HTTPResponse(request), true);
+
+	request->setServers(_serverSet->servers);
+	request->setQuota(&_serverSet->quota);
+	request->setRateLimiter(_limiter);
+	request->setPeer(_peer);
+	request->setClientfd(_fd);
+	stream->sendWindow = _initialWindow;
+	stream->input = text;
+	stream->chunked = chunked;
+	_streams[id] = stream;
+	receiveBody(stream, NULL, 0, endStream);
+}
+
+void Http2Connection::receiveBody(Stream* stream, const char* data, size_t length, bool endStream)
+{
+	HTTPRequest* request = stream->request;
+
+	if (!request->isComplete())
+	{
+		if (stream->chunked && length > 0)
+		{
+			std::ostringstream size;
+			size << std::hex << length << "\r\n";
+			stream->input += size.str();
+			stream->input.append(data, length);
+			stream->input += "\r\n";
+		}
+		else if (length > 0)
+			stream->input.append(data, length);
+		if (stream->chunked && endStream)
+			stream->input += "0\r\n\r\n";
+		request->parseRequest(stream->input);
+	}
+	// a request that is already answered has no use for the rest of its body
+	if (request->isComplete())
+		stream->input.clear();
+	if (!endStream)
+		return;
+	stream->remoteClosed = true;
+	if (!request->isComplete())
+	{
+		request->setStatusCode(400);
+		request->setState(HTTPRequest::ERROR);
+	}
+}
+
+// body data is handed to the parser right away, so the windows reopen as soon as half is used
+void Http2Connection::updateWindows(Stream* stream)
+{
+	if (_recvWindow <= H2_WINDOW_SIZE / 2)
+	{
+		queueFrame(WINDOW_UPDATE, 0, 0, encode32(H2_WINDOW_SIZE - _recvWindow));
+		_recvWindow = H2_WINDOW_SIZE;
+	}
+	if (stream && !stream->remoteClosed && !stream->request->isComplete() && stream->recvWindow <= H2_WINDOW_SIZE / 2)
+	{
+		queueFrame(WINDOW_UPDATE, 0, stream->id, encode32(H2_WINDOW_SIZE - stream->recvWindow));
+		stream->recvWindow = H2_WINDOW_SIZE;
+	}
+}
+
+void Http2Connection::process(bool draining)
+{
+	if (draining)
+		goAway(NO_ERROR);
+	_waiting = false;
+
+	std::map<uint32_t, Stream*>::iterator it = _streams.begin();
+	while (it != _streams.end())
+	{
+		Stream* stream = (it++)->second;
+
+		try
+		{
+			if (!stream->started && stream->request->isComplete())
+				startResponse(stream);
+			if (!stream->started || stream->headersSent)
+				continue;
+			if (stream->response->isReady())
+				sendHeaders(stream);
+			else
+				_waiting = true;
+		}
+		catch (const std::exception& e)
+		{
+			LOG_ERROR(e.what());
+			resetStream(stream->id, INTERNAL_ERROR);
+		}
+	}
+}
+
+void Http2Connection::startResponse(Stream* stream)
+{
+	const ServerConfig& server = stream->request->getServer();
+
+	stream->started = true;
+	_keepaliveTimeout = server.getKeepaliveTimeout();
+	// keepalive_requests caps the streams of a connection, GOAWAY sends the client to a new one
+	if (++_requests >= server.getKeepaliveRequests() || _keepaliveTimeout == 0)
+		goAway(NO_ERROR);
+	stream->response->buildResponse();
+}
+
+void Http2Connection::sendHeaders(Stream* stream)
+{
+	HTTPResponse* response = stream->response;
+	const std::map<std::string, std::string>& headers = response->getHeaders();
+	std::string block;
+
+	Hpack::encodeStatus(response->getStatusCode(), block);
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+	{
+		std::string name = it->first;
+		for (size_t i = 0; i < name.size(); ++i)
+			name[i] = std::tolower(name[i]);
+		if (!isConnectionHeader(name))
+			Hpack::encode(name, it->second, block);
+	}
+	response->skipHeader();
+	stream->headersSent = true;
+
+	bool empty = !response->hasPendingData();
+	int type = HEADERS;
+	int flags = empty ? FLAG_END_STREAM : 0;
+	size_t offset = 0;
+	do
+	{
+		size_t length = std::min(block.size() - offset, _maxFrameSize);
+		if (offset + length == block.size())
+			flags |= FLAG_END_HEADERS;
+		queueFrame(type, flags, stream->id, block.substr(offset, length));
+		offset += length;
+		type = CONTINUATION;
+		flags = 0;
+	}
+	while (offset < block.size());
+	if (empty)
+		finishStream(stream);
+}
+
+bool Http2Connection::canSend(const Stream* stream) const
+{
+	return stream->headersSent && stream->sendWindow > 0 && stream->response->hasPendingData();
+}
+
+// streams take turns, one DATA frame each
+Http2Connection::Stream* Http2Connection::nextSender()
+{
+	std::map<uint32_t, Stream*>::iterator it = _streams.upper_bound(_cursor);
+
+	for (size_t i = 0; i < _streams.size(); ++i, ++it)
+	{
+		if (it == _streams.end())
+			it = _streams.begin();
+		if (canSend(it->second))
+		{
+			_cursor = it->first;
+			return it->second;
+		}
+	}
+	return NULL;
+}
+
+ssize_t Http2Connection::getOutputChunk(char* buffer, size_t size)
+{
+	size_t length = 0;
+
+	if (_outputOffset < _output.size())
+	{
+		length = std::min(size, _output.size() - _outputOffset);
+		std::memcpy(buffer, _output.data() + _outputOffset, length);
+		_outputOffset += length;
+		if (_outputOffset == _output.size())
+		{
+			_output.clear();
+			_outputOffset = 0;
+		}
+	}
+	while (!_failed && _sendWindow > 0 && size - length > FRAME_HEADER_SIZE)
+	{
+		Stream* stream = nextSender();
+		if (!stream)
+			break;
+
+		size_t limit = std::min(size - length - FRAME_HEADER_SIZE, _maxFrameSize);
+		limit = std::min(limit, static_cast<size_t>(std::min(stream->sendWindow, _sendWindow)));
+		ssize_t count = stream->response->getResponseChunk(buffer + length + FRAME_HEADER_SIZE, limit);
+		if (count <= 0)
+		{
+			resetStream(stream->id, INTERNAL_ERROR);
+			continue;
+		}
+		bool last = !stream->response->hasPendingData();
+		writeFrameHeader(buffer + length, count, DATA, last ? FLAG_END_STREAM : 0, stream->id);
+		length += FRAME_HEADER_SIZE + count;
+		stream->sendWindow -= count;
+		_sendWindow -= count;
+		if (last)
+			finishStream(stream);
+	}
+	return length;
+}
+
+void Http2Connection::finishStream(Stream* stream)
+{
+	// the response is complete, a body still on its way is not needed
+	if (!stream->remoteClosed)
+		queueFrame(RST_STREAM, 0, stream->id, encode32(NO_ERROR));
+	closeStream(stream->id);
+}
+
+void Http2Connection::resetStream(uint32_t id, ErrorCode code)
+{
+	queueFrame(RST_STREAM, 0, id, encode32(code));
+	closeStream(id);
+}
+
+void Http2Connection::closeStream(uint32_t id)
+{
+	std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+
+	if (it == _streams.end())
+		return;
+	Stream* stream = it->second;
+	_streams.erase(it);
+	stream->request->clear();
+	stream->response->clear();
+	if (stream->owned)
+	{
+		delete stream->response;
+		delete stream->request;
+	}
+	delete stream;
+}
+
+void Http2Connection::closeStreams()
+{
+	while (!_streams.empty())
+		closeStream(_streams.begin()->first);
+}
+
+void Http2Connection::abortCgi()
+{
+	for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it)
+		if (it->second->started && !it->second->headersSent && !it->second->response->isReady())
+			it->second->response->abortCgi();
+}
+
+void Http2Connection::connectionError(ErrorCode code, const std::string& reason)
+{
+	LOG_DEBUG("HTTP/2 error on fd " + Utils::toString(_fd) + ": " + reason);
+	goAway(code);
+	_failed = true;
+	closeStreams();
+}
+
+void Http2Connection::goAway(ErrorCode code)
+{
+	if (_goawaySent && code == NO_ERROR)
+		return;
+	queueFrame(GOAWAY, 0, 0, encode32(_lastStream) + encode32(code));
+	_goawaySent = true;
+}
+
+void Http2Connection::queueFrame(int type, int flags, uint32_t id, const std::string& payload)
+{
+	char header[FRAME_HEADER_SIZE];
+
+	writeFrameHeader(header, payload.size(), type, flags, id);
+	_output.append(header, sizeof(header));
+	_output += payload;
+}
+
+void Http2Connection::writeFrameHeader(char* out, size_t length, int type, int flags, uint32_t id)
+{
+	out[0] = static_cast<char>(length >> 16);
+	out[1] = static_cast<char>(length >> 8);
+	out[2] = static_cast<char>(length);
+	out[3] = static_cast<char>(type);
+	out[4] = static_cast<char>(flags);
+	std::string streamId = encode32(id & MAX_WINDOW);
+	std::memcpy(out + 5, streamId.data(), 4);
+}
+
+bool Http2Connection::stripPadding(int flags, const char*& payload, size_t& length)
+{
+	if (!(flags & FLAG_PADDED))
+		return true;
+	if (length < 1)
+		return false;
+
+	size_t padding = static_cast<unsigned char>(payload[0]);
+	if (padding >= length)
+		return false;
+	++payload;
+	length -= padding + 1;
+	return true;
+}
+
+bool Http2Connection::hasPendingOutput() const
+{
+	if (_outputOffset < _output.size())
+		return true;
+	if (_failed || _sendWindow <= 0)
+		return false;
+	for (std::map<uint32_t, Stream*>::const_iterator it = _streams.begin(); it != _streams.end(); ++it)
+		if (canSend(it->second))
+			return true;
+	return false;
+}
+
+size_t Http2Connection::getQueuedBytes() const
+{
+	return _output.size() - _outputOffset;
+}
+
+void Http2Connection::setServerSet(ServerSet* serverSet)
+{
+	_serverSet = serverSet;
+}
+
+size_t Http2Connection::getStreamCount() const
+{
+	return _streams.size();
+}
+
+size_t Http2Connection::getKeepaliveTimeout() const
+{
+	return _keepaliveTimeout;
+}
+
+bool Http2Connection::isWaiting() const
+{
+	return _waiting;
+}
+
+bool Http2Connection::isIdle() const
+{
+	return _requests > 0 && _streams.empty() && !_headerStream && _outputOffset >= _output.size();
+}
+
+bool Http2Connection::isFinished() const
+{
+	if (_outputOffset < _output.size())
+		return false;
+	return _failed || ((_goawaySent || _goawayReceived) && _streams.empty());
+}
@@ -0,0 +1,53 @@
+#include "../include/IdleList.hpp"
+
+IdleList::Node::Node() : prev(NULL), next(NULL), data(NULL)
+{
+}
+
+bool IdleList::Node::isLinked() const
+{
+	return next != NULL;
+}
+
+IdleList::IdleList() : _size(0)
+{
+	_head.prev = &_head;
+	_head.next = &_head;
+}
+
+IdleList::~IdleList()
+{
+}
+
+void IdleList::touch(Node* node)
+{
+	remove(node);
+	node->prev = _head.prev;
+	node->next = &_head;
+	_head.prev->next = node;
+	_head.prev = node;
+	++_size;
+}
+
+void IdleList::remove(Node* node)
+{
+	if (!node->isLinked())
+		return;
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+	--_size;
+}
+
+IdleList::Node* IdleList::oldest()
+{
+	if (_head.next == &_head)
+		return NULL;
+	return _head.next;
+}
+
+size_t IdleList::size() const
+{
+	return _size;
+}
@@ -1,8 +1,65 @@
 #include "../include/LocationConfig.hpp"
 #include "../include/Utils.hpp"
 #include <sstream>
+#include <cstdlib>
 #include <iostream>
 
+LimitReq::LimitReq() : rate(0), burst(0), zone(0)
+{
+}
+
+void LimitReq::parse(const std::string& value)
+{
+	std::vector<std::string> tokens = Utils::split(value, ' ');
+
+	rate = 0;
+	burst = 0;
+	for (size_t i = 0; i < tokens.size(); ++i)
+	{
+		if (tokens[i].empty())
+			continue;
+		if (tokens[i].compare(0, 5, "rate=") == 0)
+		{
+			std::string param = tokens[i].substr(5);
+			size_t unit = param.size() < 3 ? std::string::npos : param.size() - 3;
+			size_t perUnit = 0;
+
+			if (unit == std::string::npos || unit == 0 || param.find_first_not_of("0123456789") != unit || unit > 6)
+				throw std::runtime_error("Invalid limit_req rate: " + tokens[i]);
+			perUnit = std::atoi(param.substr(0, unit).c_str());
+			if (param.substr(unit) == "r/s")
+				rate = perUnit * 60;
+			else if (param.substr(unit) == "r/m")
+				rate = perUnit;
+			else
+				throw std::runtime_error("Invalid limit_req rate unit: " + tokens[i] + " (expected r/s or r/m)");
+		}
+		else if (tokens[i].compare(0, 6, "burst=") == 0)
+		{
+			std::string param = tokens[i].substr(6);
+			if (param.empty() || param.find_first_not_of("0123456789") != std::string::npos || param.size() > 6)
+				throw std::runtime_error("Invalid limit_req burst: " + tokens[i]);
+			burst = std::atoi(param.c_str());
+		}
+		else
+			throw std::runtime_error("Unknown limit_req parameter: " + tokens[i]);
+	}
+	if (rate == 0)
+		throw std::runtime_error("limit_req requires a non-zero rate: " + value);
+	// every loop holds its own copy of the config, the zone keeps their buckets the same
+	static size_t zones = 0;
+	zone = ++zones;
+}
+
+bool LimitReq::isEnabled() const
+{
+	return rate > 0;
+}
+
+LimitRate::LimitRate() : rate(0), after(0), configured(false)
+{
+}
+
 LocationConfig::LocationConfig() : _root("./www/html"), _path("/"), _index("index.html"), _autoindex(false), _uploadPath("./www/upload"), _redirectCode(0), _redirectPath("")
 {
 }
@@ -125,6 +182,33 @@ void LocationConfig::setRedirect(const std::string& redirectValue)
 	_redirectPath = path;
 }
 
+void LocationConfig::setLimitReq(const std::string& value)
+{
+	_limitReq.parse(value);
+}
+
+const LimitReq& LocationConfig::getLimitReq() const
+{
+	return _limitReq;
+}
+
+void LocationConfig::setLimitRate(const std::string& value)
+{
+	_limitRate.rate = Utils::stringToSizeT(value);
+	_limitRate.configured = true;
+}
+
+void LocationConfig::setLimitRateAfter(const std::string& value)
+{
+	_limitRate.after = Utils::stringToSizeT(value);
+	_limitRate.configured = true;
+}
+
+const LimitRate& LocationConfig::getLimitRate() const
+{
+	return _limitRate;
+}
+
 const std::string& LocationConfig::getRoot() const 
 {
 	return _root;
@@ -35,39 +35,81 @@ void Logger::fatal(const std::string& message)
     log(FATAL, message);
 }
 
+// the admin socket changes the level while every loop thread is logging
+void Logger::setLevel(LogLevel level)
+{
+    __atomic_store_n(&_currentLevel, static_cast<int>(level), __ATOMIC_RELAXED);
+}
+
+Logger::LogLevel Logger::getLevel() const
+{
+    return static_cast<LogLevel>(__atomic_load_n(&_currentLevel, __ATOMIC_RELAXED));
+}
+
+bool Logger::parseLevel(const std::string& name, LogLevel& level)
+{
+    for (int i = DEBUG; i <= FATAL; ++i)
+    {
+        if (getLevelName(static_cast<LogLevel>(i)) == name)
+        {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string Logger::getLevelName(LogLevel level)
+{
+    switch(level)
+    {
+        case DEBUG: return "debug";
+        case INFO: return "info";
+        case WARNING: return "warning";
+        case ERROR: return "error";
+        case FATAL: return "fatal";
+        default: return "unknown";
+    }
+}
+
 void Logger::log(LogLevel level, const std::string& message)
 {
+    if (level < getLevel())
+        return;
 
-    std::cout << COLOR_TIME  << "[" << getTimestamp() << "] " << COLOR_RESET;
+    std::string line = std::string(COLOR_TIME) + "[" + getTimestamp() + "] " + COLOR_RESET;
     
     switch(level)
     {
         case DEBUG:
-            std::cout << COLOR_DEBUG;
+            line += COLOR_DEBUG;
             break;
         case INFO:
-            std::cout << COLOR_INFO;
+            line += COLOR_INFO;
             break;
         case WARNING:
-            std::cout << COLOR_WARNING;
+            line += COLOR_WARNING;
             break;
         case ERROR:
-            std::cout << COLOR_ERROR;
+            line += COLOR_ERROR;
             break;
         case FATAL:
-            std::cout << COLOR_FATAL;
+            line += COLOR_FATAL;
             break;
     }
     
-    std::cout << message << COLOR_RESET << std::endl;
+    line += message + COLOR_RESET + "\n";
+    std::cout << line << std::flush;
 }
 
 std::string Logger::getTimestamp() 
 {
     time_t now;
     time(&now);
+    struct tm local;
+    localtime_r(&now, &local);
     char buf[20];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
     return std::string(buf);
 }
 
@@ -0,0 +1,278 @@
+#include "../include/RateLimiter.hpp"
+#include "../include/ServerConfig.hpp"
+#include "../include/TimerWheel.hpp"
+#include <cstring>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// one request in rate-per-minute * millisecond units, so refills stay exact
+#define LIMIT_UNIT 60000ULL
+#define LIMIT_MAX_ELAPSED 3600000ULL
+
+PeerAddress::PeerAddress() : family(AF_UNSPEC)
+{
+	std::memset(addr, 0, sizeof(addr));
+}
+
+PeerAddress::PeerAddress(const struct sockaddr* address) : family(address->sa_family)
+{
+	std::memset(addr, 0, sizeof(addr));
+	if (family == AF_INET)
+		std::memcpy(addr, &reinterpret_cast<const struct sockaddr_in*>(address)->sin_addr, 4);
+	else if (family == AF_INET6)
+		std::memcpy(addr, &reinterpret_cast<const struct sockaddr_in6*>(address)->sin6_addr, 16);
+}
+
+bool PeerAddress::operator==(const PeerAddress& other) const
+{
+	return family == other.family && std::memcmp(addr, other.addr, sizeof(addr)) == 0;
+}
+
+std::string PeerAddress::toString() const
+{
+	char buffer[INET6_ADDRSTRLEN];
+
+	if (hasAddress() && inet_ntop(family, addr, buffer, sizeof(buffer)))
+		return buffer;
+	if (family == AF_UNIX)
+		return "unix:";
+	return "unknown";
+}
+
+bool PeerAddress::hasAddress() const
+{
+	return family == AF_INET || family == AF_INET6;
+}
+
+RateLimiter::Entry::Entry() : zone(0), connections(0), tokens(0), updated(0), expires(0), used(false)
+{
+}
+
+// a peer always maps to the same shard, so every loop of the process shares its counters
+RateLimiter::RateLimiter(size_t capacity, size_t shards) : _minCapacity(16), _maxCapacity(16)
+{
+	if (shards < 1)
+		shards = 1;
+	while (_minCapacity * shards < capacity)
+		_minCapacity <<= 1;
+	while (_maxCapacity * shards < static_cast<size_t>(LIMIT_TABLE_MAX))
+		_maxCapacity <<= 1;
+	for (size_t i = 0; i < shards; ++i)
+	{
+		Shard* shard = new Shard();
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->entries.resize(_minCapacity);
+		shard->used = 0;
+		_shards.push_back(shard);
+	}
+}
+
+RateLimiter::~RateLimiter()
+{
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		pthread_mutex_destroy(&_shards[i]->lock);
+		delete _shards[i];
+	}
+}
+
+size_t RateLimiter::size()
+{
+	size_t used = 0;
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		pthread_mutex_lock(&_shards[i]->lock);
+		used += _shards[i]->used;
+		pthread_mutex_unlock(&_shards[i]->lock);
+	}
+	return used;
+}
+
+RateLimiter::Shard& RateLimiter::getShard(const PeerAddress& peer)
+{
+	return *_shards[(hash(peer, 0) >> 16) % _shards.size()];
+}
+
+size_t RateLimiter::hash(const PeerAddress& peer, size_t zone)
+{
+	uint64_t value = 14695981039346656037ULL;
+	uint64_t tag = zone;
+
+	value = (value ^ peer.family) * 1099511628211ULL;
+	for (size_t i = 0; i < sizeof(peer.addr); ++i)
+		value = (value ^ peer.addr[i]) * 1099511628211ULL;
+	for (size_t i = 0; i < sizeof(tag); ++i)
+		value = (value ^ ((tag >> (i * 8)) & 0xff)) * 1099511628211ULL;
+	return static_cast<size_t>(value ^ (value >> 32));
+}
+
+bool RateLimiter::isStale(const Entry& entry, uint64_t now)
+{
+	return entry.connections == 0 && now >= entry.expires;
+}
+
+RateLimiter::Entry* RateLimiter::lookup(Shard& shard, const PeerAddress& peer, size_t zone, bool create, uint64_t now)
+{
+	std::vector<Entry>& entries = shard.entries;
+	size_t mask = entries.size() - 1;
+	size_t index = hash(peer, zone) & mask;
+	Entry* reusable = NULL;
+
+	while (entries[index].used)
+	{
+		Entry& entry = entries[index];
+		if (entry.zone == zone && entry.peer == peer)
+			return &entry;
+		if (!reusable && isStale(entry, now))
+			reusable = &entry;
+		index = (index + 1) & mask;
+	}
+	if (!create)
+		return NULL;
+
+	if (!reusable)
+	{
+		if ((shard.used + 1) * 4 > entries.size() * 3)
+		{
+			if (!rehash(shard, now))
+				return NULL;
+			return lookup(shard, peer, zone, create, now);
+		}
+		reusable = &entries[index];
+		++shard.used;
+	}
+
+	// a stale entry is indistinguishable from a fresh one, so reusing it is safe
+	reusable->peer = peer;
+	reusable->zone = zone;
+	reusable->connections = 0;
+	reusable->tokens = ~0ULL;
+	reusable->updated = now;
+	reusable->expires = 0;
+	reusable->used = true;
+	return reusable;
+}
+
+size_t RateLimiter::countLive(const Shard& shard, uint64_t now)
+{
+	size_t live = 0;
+	for (size_t i = 0; i < shard.entries.size(); ++i)
+		if (shard.entries[i].used && !isStale(shard.entries[i], now))
+			++live;
+	return live;
+}
+
+bool RateLimiter::rehash(Shard& shard, uint64_t now)
+{
+	size_t live = countLive(shard, now);
+
+	size_t capacity = shard.entries.size();
+	while ((live + 1) * 2 > capacity && capacity < _maxCapacity)
+		capacity <<= 1;
+	if ((live + 1) * 4 > capacity * 3)
+		return false;
+	rebuild(shard, capacity, now);
+	return true;
+}
+
+size_t RateLimiter::purge()
+{
+	uint64_t now = TimerWheel::now();
+	size_t purged = 0;
+
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Shard& shard = *_shards[i];
+		pthread_mutex_lock(&shard.lock);
+		size_t before = shard.used;
+		size_t live = countLive(shard, now);
+
+		size_t capacity = _minCapacity;
+		while ((live + 1) * 2 > capacity)
+			capacity <<= 1;
+		rebuild(shard, capacity, now);
+		purged += before - shard.used;
+		pthread_mutex_unlock(&shard.lock);
+	}
+	return purged;
+}
+
+void RateLimiter::rebuild(Shard& shard, size_t capacity, uint64_t now)
+{
+	std::vector<Entry> old(capacity);
+	old.swap(shard.entries);
+	shard.used = 0;
+
+	size_t mask = capacity - 1;
+	for (size_t i = 0; i < old.size(); ++i)
+	{
+		if (!old[i].used || isStale(old[i], now))
+			continue;
+		size_t index = hash(old[i].peer, old[i].zone) & mask;
+		while (shard.entries[index].used)
+			index = (index + 1) & mask;
+		shard.entries[index] = old[i];
+		++shard.used;
+	}
+}
+
+// unix-socket peers share no address to tell them apart, so they are never limited
+bool RateLimiter::acquireConnection(const PeerAddress& peer, size_t limit)
+{
+	if (!peer.hasAddress())
+		return true;
+
+	Shard& shard = getShard(peer);
+	pthread_mutex_lock(&shard.lock);
+	Entry* entry = lookup(shard, peer, 0, true, TimerWheel::now());
+	bool acquired = !entry || limit == 0 || entry->connections < limit;
+	if (entry && acquired)
+		++entry->connections;
+	pthread_mutex_unlock(&shard.lock);
+	return acquired;
+}
+
+void RateLimiter::releaseConnection(const PeerAddress& peer)
+{
+	Shard& shard = getShard(peer);
+	pthread_mutex_lock(&shard.lock);
+	Entry* entry = lookup(shard, peer, 0, false, 0);
+
+	if (entry && entry->connections > 0)
+		--entry->connections;
+	pthread_mutex_unlock(&shard.lock);
+}
+
+bool RateLimiter::admitRequest(const PeerAddress& peer, const LimitReq& rule)
+{
+	if (!peer.hasAddress())
+		return true;
+
+	uint64_t now = TimerWheel::now();
+	Shard& shard = getShard(peer);
+	pthread_mutex_lock(&shard.lock);
+	Entry* entry = lookup(shard, peer, rule.zone, true, now);
+
+	if (!entry)
+	{
+		pthread_mutex_unlock(&shard.lock);
+		return true;
+	}
+
+	uint64_t capacity = (rule.burst + 1) * LIMIT_UNIT;
+	uint64_t elapsed = now > entry->updated ? now - entry->updated : 0;
+	if (elapsed > LIMIT_MAX_ELAPSED)
+		elapsed = LIMIT_MAX_ELAPSED;
+	if (entry->tokens < capacity)
+		entry->tokens += elapsed * rule.rate;
+	if (entry->tokens > capacity)
+		entry->tokens = capacity;
+	entry->updated = now;
+
+	bool admitted = entry->tokens >= LIMIT_UNIT;
+	if (admitted)
+		entry->tokens -= LIMIT_UNIT;
+	entry->expires = now + (capacity - entry->tokens + rule.rate - 1) / rule.rate;
+	pthread_mutex_unlock(&shard.lock);
+	return admitted;
+}
@@ -11,8 +11,57 @@
 #include <algorithm>
 #include <stdexcept>
 #include <cstdlib>
+#include <sys/un.h>
 
-ServerConfig::ServerConfig() : _host(""), _serverName("default"), _root("./www/html"), _clientMaxBodySize(1048576), _clientBodyTmpPath("/tmp"), _errorPages(), _isDefault(false)
+ListenOptions::ListenOptions() : backlog(-1), ssl(false), http2(false), nodelay(true), cork(false), deferAccept(0), fastOpen(0), rcvbuf(-1), sndbuf(-1), notsentLowat(-1), keepalive(false), keepIdle(0), keepInterval(0), keepCount(0)
+{
+}
+
+static int parseListenNumber(const std::string& param, const std::string& token, int min, int max)
+{
+	if (param.empty() || param.find_first_not_of("0123456789") != std::string::npos || param.size() > 9)
+		throw std::runtime_error("Invalid listen parameter: " + token);
+	int value = std::atoi(param.c_str());
+	if (value < min || value > max)
+		throw std::runtime_error("Listen parameter out of range (" + Utils::toString(min) + "-" + Utils::toString(max) + "): " + token);
+	return value;
+}
+
+static bool parseListenSwitch(const std::string& param, const std::string& token)
+{
+	if (param.empty() || param == "on")
+		return true;
+	if (param == "off")
+		return false;
+	throw std::runtime_error("Invalid listen parameter: " + token);
+}
+
+// so_keepalive=on|off|[idle]:[interval]:[count], an empty field keeps the system default
+static void parseKeepalive(const std::string& param, const std::string& token, ListenOptions& options)
+{
+	size_t first = param.find(':');
+	if (first == std::string::npos)
+	{
+		options.keepalive = parseListenSwitch(param, token);
+		return;
+	}
+	size_t second = param.find(':', first + 1);
+	if (second == std::string::npos)
+		throw std::runtime_error("Invalid listen parameter: " + token);
+
+	std::string idle = param.substr(0, first);
+	std::string interval = param.substr(first + 1, second - first - 1);
+	std::string count = param.substr(second + 1);
+	options.keepalive = true;
+	if (!idle.empty())
+		options.keepIdle = parseListenNumber(idle, token, 1, 32767);
+	if (!interval.empty())
+		options.keepInterval = parseListenNumber(interval, token, 1, 32767);
+	if (!count.empty())
+		options.keepCount = parseListenNumber(count, token, 1, 127);
+}
+
+ServerConfig::ServerConfig() : _host(""), _serverName("default"), _root("./www/html"), _clientMaxBodySize(1048576), _keepaliveRequests(KEEPALIVE_REQUESTS), _keepaliveTimeout(TIMEOUT), _clientHeaderTimeout(TIMEOUT), _clientBodyTimeout(TIMEOUT), _clientBodyMinRate(0), _limitConn(0), _maxConnections(0), _maxCgiProcesses(0), _maxBodyInFlight(0), _clientBodyTmpPath("/tmp"), _errorPages(), _workerThreads(1), _workerProcesses(1), _edgeTriggered(false), _maxEgressRate(0), _isDefault(false)
 {
 }
 
@@ -21,6 +70,11 @@ ServerConfig::ServerConfig(const std::string& configFilePath)
 	ConfigParser parser(configFilePath);
 	parser.parseFile();
 	_servers = parser.getServers();
+	_workerThreads = parser.getWorkerThreads();
+	_workerProcesses = parser.getWorkerProcesses();
+	_edgeTriggered = parser.isEdgeTriggered();
+	_maxEgressRate = parser.getMaxEgressRate();
+	_adminSocket = parser.getAdminSocket();
 }
 
 ServerConfig::~ServerConfig() 
@@ -43,6 +97,31 @@ std::vector<ServerConfig> ServerConfig::getServers() const
 	return _servers;
 }
 
+size_t ServerConfig::getWorkerThreads() const
+{
+	return _workerThreads;
+}
+
+size_t ServerConfig::getWorkerProcesses() const
+{
+	return _workerProcesses;
+}
+
+bool ServerConfig::isEdgeTriggered() const
+{
+	return _edgeTriggered;
+}
+
+size_t ServerConfig::getMaxEgressRate() const
+{
+	return _maxEgressRate;
+}
+
+const std::string& ServerConfig::getAdminSocket() const
+{
+	return _adminSocket;
+}
+
 const LocationConfig& ServerConfig::findLocation(const std::string& path) const 
 {
 	const std::map<std::string, LocationConfig>& locations = getLocations();
@@ -72,16 +151,73 @@ bool ServerConfig::isValidHost(const std::string& host)
 }
 
 
-void ServerConfig::setHostPort(const std::string& hostPort) 
+void ServerConfig::setHostPort(const std::string& value) 
 {
-	if (hostPort.empty()) 
+	std::vector<std::string> tokens;
+	std::istringstream iss(value);
+	std::string token;
+	while (iss >> token)
+		tokens.push_back(token);
+
+	if (tokens.empty()) 
 		throw std::runtime_error("Host:Port cannot be empty");
 
+	const std::string& hostPort = tokens[0];
+	ListenOptions options;
+	for (size_t i = 1; i < tokens.size(); ++i)
+	{
+		size_t eqPos = tokens[i].find('=');
+		std::string name = tokens[i].substr(0, eqPos);
+		std::string param = eqPos == std::string::npos ? "" : tokens[i].substr(eqPos + 1);
+
+		if (name == "backlog")
+		{
+			if (param.empty() || param.find_first_not_of("0123456789") != std::string::npos || param.size() > 9 || std::atoi(param.c_str()) < 1)
+				throw std::runtime_error("Invalid listen backlog: " + tokens[i]);
+			options.backlog = std::atoi(param.c_str());
+		}
+		else if (name == "ssl" && param.empty())
+			options.ssl = true;
+		else if (name == "http2" && param.empty())
+			options.http2 = true;
+		else if (name == "nodelay")
+			options.nodelay = parseListenSwitch(param, tokens[i]);
+		else if (name == "cork")
+			options.cork = parseListenSwitch(param, tokens[i]);
+		else if (name == "deferred")
+			options.deferAccept = param.empty() ? LISTEN_DEFER_ACCEPT : parseListenNumber(param, tokens[i], 0, 3600);
+		else if (name == "fastopen")
+			options.fastOpen = parseListenNumber(param, tokens[i], 0, 65535);
+		else if (name == "rcvbuf")
+			options.rcvbuf = parseListenNumber(param, tokens[i], 1, 1 << 30);
+		else if (name == "sndbuf")
+			options.sndbuf = parseListenNumber(param, tokens[i], 1, 1 << 30);
+		else if (name == "notsent_lowat")
+			options.notsentLowat = parseListenNumber(param, tokens[i], 1, 1 << 30);
+		else if (name == "so_keepalive")
+			parseKeepalive(param, tokens[i], options);
+		else
+			throw std::runtime_error("Unknown listen parameter: " + tokens[i]);
+	}
+
+	if (hostPort.compare(0, 5, "unix:") == 0)
+		return addUnixListener(hostPort, options);
+
 	size_t colonPos = hostPort.find(':');
 	std::string host;
 	std::string portStr;
 
-	if (colonPos == std::string::npos) 
+	if (hostPort[0] == '[')
+	{
+		size_t closing = hostPort.find(']');
+		if (closing == std::string::npos || closing + 1 >= hostPort.size() || hostPort[closing + 1] != ':')
+			throw std::runtime_error("Invalid IPv6 listen address, expected [address]:port: " + hostPort);
+		host = hostPort.substr(1, closing - 1);
+		portStr = hostPort.substr(closing + 2);
+		if (portStr.empty())
+			throw std::runtime_error("Port cannot be empty after colon");
+	}
+	else if (colonPos == std::string::npos) 
 	{
 		host = "0.0.0.0";
 		portStr = hostPort;
@@ -106,8 +242,17 @@ void ServerConfig::setHostPort(const std::string& hostPort)
 		throw std::runtime_error("Port out of range (1-65535): " + portStr);
 
 	std::string resolved_host;
+	struct in6_addr address6;
 
-	if (isValidHost(host)) 
+	if (hostPort[0] == '[')
+	{
+		char buffer[INET6_ADDRSTRLEN];
+		if (inet_pton(AF_INET6, host.c_str(), &address6) != 1)
+			throw std::runtime_error("Invalid IPv6 address: " + host);
+		// the canonical form is what getsockname() reports back for the socket
+		resolved_host = inet_ntop(AF_INET6, &address6, buffer, sizeof(buffer));
+	}
+	else if (isValidHost(host)) 
 		resolved_host = host;
 	else 
 	{
@@ -124,6 +269,33 @@ void ServerConfig::setHostPort(const std::string& hostPort)
 			throw std::runtime_error("Port " + portStr + " already assigned to host: " + resolved_host);
 
 	ports.push_back(port);
+	_listenOptions[Utils::getListenKey(resolved_host, port)] = options;
+}
+
+// a unix listener is stored as host "unix:<path>" with port 0
+void ServerConfig::addUnixListener(const std::string& host, const ListenOptions& options)
+{
+	std::string path = host.substr(5);
+
+	if (path.empty() || path[0] != '/')
+		throw std::runtime_error("unix listen path must be absolute: " + host);
+	if (path.size() >= sizeof(((struct sockaddr_un*)0)->sun_path))
+		throw std::runtime_error("unix listen path too long: " + host);
+	if (!_host_ports[host].empty())
+		throw std::runtime_error("Socket " + path + " already assigned");
+
+	_host_ports[host].push_back(0);
+	_listenOptions[host] = options;
+}
+
+const ListenOptions& ServerConfig::getListenOptions(const std::string& host, uint16_t port) const
+{
+	static const ListenOptions defaults;
+
+	std::map<std::string, ListenOptions>::const_iterator it = _listenOptions.find(Utils::getListenKey(host, port));
+	if (it != _listenOptions.end())
+		return it->second;
+	return defaults;
 }
 
 std::vector<uint16_t> ServerConfig::getPortsByHost(const std::string& host) const
@@ -164,6 +336,142 @@ void ServerConfig::setClientMaxBodySize(const std::string& size)
 	_clientMaxBodySize = Utils::stringToSizeT(size);
 }
 
+void ServerConfig::setKeepaliveRequests(const std::string& value)
+{
+	_keepaliveRequests = Utils::stringToSizeT(value);
+	if (_keepaliveRequests < 1)
+		throw std::runtime_error("keepalive_requests must be at least 1: " + value);
+}
+
+size_t ServerConfig::getKeepaliveRequests() const
+{
+	return _keepaliveRequests;
+}
+
+static size_t parseSeconds(const std::string& value, const std::string& directive, size_t min)
+{
+	std::string seconds = value;
+	if (!seconds.empty() && seconds[seconds.size() - 1] == 's')
+		seconds.erase(seconds.size() - 1);
+	size_t result = Utils::stringToSizeT(seconds);
+	if (result < min || result > 3600)
+		throw std::runtime_error(directive + " out of range (" + Utils::toString(min) + "-3600s): " + value);
+	return result;
+}
+
+void ServerConfig::setKeepaliveTimeout(const std::string& value)
+{
+	_keepaliveTimeout = parseSeconds(value, "keepalive_timeout", 0);
+}
+
+size_t ServerConfig::getKeepaliveTimeout() const
+{
+	return _keepaliveTimeout;
+}
+
+void ServerConfig::setClientHeaderTimeout(const std::string& value)
+{
+	_clientHeaderTimeout = parseSeconds(value, "client_header_timeout", 1);
+}
+
+size_t ServerConfig::getClientHeaderTimeout() const
+{
+	return _clientHeaderTimeout;
+}
+
+void ServerConfig::setClientBodyTimeout(const std::string& value)
+{
+	_clientBodyTimeout = parseSeconds(value, "client_body_timeout", 1);
+}
+
+size_t ServerConfig::getClientBodyTimeout() const
+{
+	return _clientBodyTimeout;
+}
+
+void ServerConfig::setClientBodyMinRate(const std::string& value)
+{
+	_clientBodyMinRate = Utils::stringToSizeT(value);
+}
+
+size_t ServerConfig::getClientBodyMinRate() const
+{
+	return _clientBodyMinRate;
+}
+
+void ServerConfig::setLimitConn(const std::string& value)
+{
+	_limitConn = Utils::stringToSizeT(value);
+	if (_limitConn < 1)
+		throw std::runtime_error("limit_conn must be at least 1: " + value);
+}
+
+size_t ServerConfig::getLimitConn() const
+{
+	return _limitConn;
+}
+
+void ServerConfig::setLimitReq(const std::string& value)
+{
+	_limitReq.parse(value);
+}
+
+const LimitReq& ServerConfig::getLimitReq() const
+{
+	return _limitReq;
+}
+
+void ServerConfig::setLimitRate(const std::string& value)
+{
+	_limitRate.rate = Utils::stringToSizeT(value);
+}
+
+void ServerConfig::setLimitRateAfter(const std::string& value)
+{
+	_limitRate.after = Utils::stringToSizeT(value);
+}
+
+const LimitRate& ServerConfig::getLimitRate() const
+{
+	return _limitRate;
+}
+
+void ServerConfig::setMaxConnections(const std::string& value)
+{
+	_maxConnections = Utils::stringToSizeT(value);
+	if (_maxConnections < 1)
+		throw std::runtime_error("max_connections must be at least 1: " + value);
+}
+
+size_t ServerConfig::getMaxConnections() const
+{
+	return _maxConnections;
+}
+
+void ServerConfig::setMaxCgiProcesses(const std::string& value)
+{
+	_maxCgiProcesses = Utils::stringToSizeT(value);
+	if (_maxCgiProcesses < 1)
+		throw std::runtime_error("max_cgi_processes must be at least 1: " + value);
+}
+
+size_t ServerConfig::getMaxCgiProcesses() const
+{
+	return _maxCgiProcesses;
+}
+
+void ServerConfig::setMaxBodyInFlight(const std::string& value)
+{
+	_maxBodyInFlight = Utils::stringToSizeT(value);
+	if (_maxBodyInFlight < 1)
+		throw std::runtime_error("max_body_in_flight must be at least 1: " + value);
+}
+
+size_t ServerConfig::getMaxBodyInFlight() const
+{
+	return _maxBodyInFlight;
+}
+
 void ServerConfig::setClientBodyTmpPath(const std::string& path) 
 {
 	if ( _clientBodyTmpPath != "/tmp")
@@ -176,6 +484,42 @@ std::string ServerConfig::getClientBodyTmpPath() const
 	return _clientBodyTmpPath;
 }
 
+void ServerConfig::setSslCertificate(const std::string& path)
+{
+	if (!_sslCertificate.empty())
+		throw std::runtime_error("ssl_certificate duplicated");
+	if (!Utils::isFileReadble(path))
+		throw std::runtime_error("ssl_certificate is not readable: " + path);
+	_sslCertificate = path;
+}
+
+void ServerConfig::setSslCertificateKey(const std::string& path)
+{
+	if (!_sslCertificateKey.empty())
+		throw std::runtime_error("ssl_certificate_key duplicated");
+	if (!Utils::isFileReadble(path))
+		throw std::runtime_error("ssl_certificate_key is not readable: " + path);
+	_sslCertificateKey = path;
+}
+
+const std::string& ServerConfig::getSslCertificate() const
+{
+	return _sslCertificate;
+}
+
+const std::string& ServerConfig::getSslCertificateKey() const
+{
+	return _sslCertificateKey;
+}
+
+bool ServerConfig::hasSslListener() const
+{
+	for (std::map<std::string, ListenOptions>::const_iterator it = _listenOptions.begin(); it != _listenOptions.end(); ++it)
+		if (it->second.ssl)
+			return true;
+	return false;
+}
+
 void ServerConfig::setErrorPage(const std::string& value) 
 {
 	std::istringstream iss(value);
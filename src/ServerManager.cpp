@@ -1,73 +1,188 @@
 #include "../include/ServerManager.hpp"
-#include "../include/CGIHandler.hpp"
 #include "../include/Logger.hpp"
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <stdexcept>
-#include <sys/epoll.h>
-#include <wait.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
 #include <algorithm>
+#include <new>
+#include <sys/mman.h>
 
-ServerManager::ServerManager(const std::vector<ServerConfig>& servers) : _epoll(EVENTS), _running(false), _servers(servers)
+#define LISTEN_FDS_ENV "WEBSERV_LISTEN_FDS"
+#define UPGRADE_PID_ENV "WEBSERV_UPGRADE_PID"
+
+extern char** environ;
+
+ServerManager::ServerManager(const ServerConfig& config, const std::string& configFile) : _configFile(configFile), _servers(config.getServers()), _workerThreads(config.getWorkerThreads()), _workerProcesses(config.getWorkerProcesses()), _maxEgressRate(config.getMaxEgressRate()), _adminSocket(config.getAdminSocket()), _admin(NULL), _workerSlot(-1), _edgeTriggered(config.isEdgeTriggered()), _running(false), _reloadRequested(0), _drainRequested(0), _upgradeRequested(0), _upgradePid(-1), _upgradeParent(-1), _limiter(LIMIT_TABLE_SIZE, LIMIT_TABLE_SHARDS), _egress(NULL)
 {
+	// mapped before any worker is forked, so threads and worker processes draw from one egress cap
+	void* shared = mmap(NULL, sizeof(TokenBucket), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		throw std::runtime_error(std::string("mmap: ") + strerror(errno));
+	_egress = new (shared) TokenBucket();
+	_egress->configure(_maxEgressRate, TimerWheel::now());
+	// the ticket secret is inherited by every worker, so tickets resume across processes
+	TlsContext::initTicketKeys();
 }
 
 ServerManager::~ServerManager()
 {
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) 
+	delete _admin;
+	_admin = NULL;
+	for (size_t i = 0; i < _loops.size(); ++i)
+		delete _loops[i];
+	_loops.clear();
+
+	// after a binary upgrade the new process still accepts on our unix sockets
+	closeUnused(collectFds(_loopListeners), std::vector<ListenerMap>(), _workerSlot < 0 && _upgradePid <= 0);
+	_loopListeners.clear();
+	_egress->~TokenBucket();
+	munmap(_egress, sizeof(TokenBucket));
+}
+
+static void wakeSupervisor(int signum)
+{
+	(void) signum;
+}
+
+int ServerManager::getDefaultBacklog()
+{
+	static int backlog = 0;
+
+	if (backlog == 0)
 	{
-		close(it->first);
-		delete it->second;
+		std::ifstream file("/proc/sys/net/core/somaxconn");
+		if (!(file >> backlog) || backlog <= 0)
+			backlog = SOMAXCONN;
 	}
-	_clients.clear();
+	return backlog;
+}
 
-	for (size_t i = 0; i < _serverFds.size(); ++i)
-		close(_serverFds[i]);
-	_serverFds.clear();
+static socklen_t makeSocketAddress(const std::string& host, uint16_t port, struct sockaddr_storage& storage)
+{
+	memset(&storage, 0, sizeof(storage));
+	if (host.compare(0, 5, "unix:") == 0)
+	{
+		struct sockaddr_un* address = reinterpret_cast<struct sockaddr_un*>(&storage);
+		std::string path = host.substr(5);
+		if (path.size() >= sizeof(address->sun_path))
+			return 0;
+		address->sun_family = AF_UNIX;
+		memcpy(address->sun_path, path.c_str(), path.size() + 1);
+		return sizeof(*address);
+	}
+	if (host.find(':') != std::string::npos)
+	{
+		struct sockaddr_in6* address = reinterpret_cast<struct sockaddr_in6*>(&storage);
+		address->sin6_family = AF_INET6;
+		address->sin6_port = htons(port);
+		return inet_pton(AF_INET6, host.c_str(), &address->sin6_addr) == 1 ? sizeof(*address) : 0;
+	}
+	struct sockaddr_in* address = reinterpret_cast<struct sockaddr_in*>(&storage);
+	address->sin_family = AF_INET;
+	address->sin_port = htons(port);
+	return inet_pton(AF_INET, host.c_str(), &address->sin_addr) == 1 ? sizeof(*address) : 0;
+}
+
+// a socket file nobody accepts on is left over from a crash, a live one makes bind() fail
+static void removeStaleSocket(const struct sockaddr* address, socklen_t length)
+{
+	const char* path = reinterpret_cast<const struct sockaddr_un*>(address)->sun_path;
+	struct stat info;
+
+	if (lstat(path, &info) == -1 || !S_ISSOCK(info.st_mode))
+		return;
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0)
+		return;
+	if (connect(probe, address, length) == -1 && errno == ECONNREFUSED)
+		unlink(path);
+	close(probe);
 }
 
-int ServerManager::createAndBindSocket(const std::string& host, uint16_t port)
+int ServerManager::createAndBindSocket(const std::string& host, uint16_t port, bool reusePort, const ListenOptions& options)
 {
-	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_storage address;
+	socklen_t length = makeSocketAddress(host, port, address);
+	if (length == 0)
+		return -1;
+
+	int sockfd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sockfd < 0)
 		return -1;
 
 	int opt = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
-		return (close(sockfd), -1);
-
-	if (fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0)
+	if (address.ss_family == AF_UNIX)
+		removeStaleSocket(reinterpret_cast<struct sockaddr*>(&address), length);
+	else
+	{
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+			return (close(sockfd), -1);
+		if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+			return (close(sockfd), -1);
+	}
+	// [::] would otherwise also claim the IPv4 port of a separate 0.0.0.0 listener
+	if (address.ss_family == AF_INET6 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0)
 		return (close(sockfd), -1);
 
-	struct sockaddr_in address;
-	memset(&address, 0, sizeof(address));
-	address.sin_family = AF_INET;
-	address.sin_port = htons(port);
+	// buffer sizes must be in place before listen() to take part in window scaling
+	applyListenOptions(sockfd, Utils::getListenKey(host, port), options);
 
-	if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) <= 0)
+	if (bind(sockfd, reinterpret_cast<struct sockaddr*>(&address), length) < 0)
 		return (close(sockfd), -1);
 
-	if (bind(sockfd, (struct sockaddr*)&address, sizeof(address)) < 0)
+	if (listen(sockfd, options.backlog > 0 ? options.backlog : getDefaultBacklog()) < 0)
 		return (close(sockfd), -1);
 
+	return sockfd;
+}
 
-	if (listen(sockfd, 10) < 0)
-		return (close(sockfd), -1);
-
+static void setListenOption(int fd, int level, int name, int value, const char* option, const std::string& key)
+{
+	if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+		LOG_WARN(std::string("Failed to set ") + option + " on " + key + ": " + strerror(errno));
+}
 
-	return sockfd;
+// accepted sockets inherit these from the listener, so no per-connection setsockopt is needed
+void ServerManager::applyListenOptions(int fd, const std::string& key, const ListenOptions& options)
+{
+	if (options.rcvbuf > 0)
+		setListenOption(fd, SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF", key);
+	if (options.sndbuf > 0)
+		setListenOption(fd, SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF", key);
+	if (key.compare(0, 5, "unix:") == 0)
+		return;
+	setListenOption(fd, IPPROTO_TCP, TCP_NODELAY, options.nodelay, "TCP_NODELAY", key);
+	setListenOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferAccept, "TCP_DEFER_ACCEPT", key);
+	setListenOption(fd, SOL_SOCKET, SO_KEEPALIVE, options.keepalive, "SO_KEEPALIVE", key);
+	if (options.fastOpen > 0)
+		setListenOption(fd, IPPROTO_TCP, TCP_FASTOPEN, options.fastOpen, "TCP_FASTOPEN", key);
+	if (options.notsentLowat > 0)
+		setListenOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notsentLowat, "TCP_NOTSENT_LOWAT", key);
+	if (options.keepIdle > 0)
+		setListenOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepIdle, "TCP_KEEPIDLE", key);
+	if (options.keepInterval > 0)
+		setListenOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepInterval, "TCP_KEEPINTVL", key);
+	if (options.keepCount > 0)
+		setListenOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepCount, "TCP_KEEPCNT", key);
 }
 
-bool ServerManager::init()
+bool ServerManager::bindListeners(const std::vector<ServerConfig>& servers, const ListenerMap& current, const ListenerMap& shared, ListenerMap& listeners, bool reusePort, bool verbose)
 {
-	std::map<std::string, std::map<uint16_t, int> > host_port_fd;
-	for (size_t i = 0; i < _servers.size(); ++i)
+	try
 	{
-		try
+		for (size_t i = 0; i < servers.size(); ++i)
 		{
-			const std::map<std::string, std::vector<uint16_t> >& host_ports = _servers[i].getHostPort();
+			const std::map<std::string, std::vector<uint16_t> >& host_ports = servers[i].getHostPort();
 
 			std::map<std::string, std::vector<uint16_t> >::const_iterator it;
 			for (it = host_ports.begin(); it != host_ports.end(); ++it)
@@ -78,203 +193,628 @@ bool ServerManager::init()
 				for (size_t j = 0; j < ports.size(); ++j)
 				{
 					uint16_t port = ports[j];
+					std::string key = Utils::getListenKey(host, port);
 
-					if (host_port_fd.count(host) && host_port_fd[host].count(port))
+					if (listeners.count(key))
 						continue;
 
-					int fd = createAndBindSocket(host, port);
-					if (fd < 0)
-						throw std::runtime_error("Failed to bind socket for " + host + ":" + Utils::toString(port));
-
-					if (!_epoll.add(fd, EPOLLIN))
+					const ListenOptions& options = servers[i].getListenOptions(host, port);
+					ListenerMap::const_iterator found = current.find(key);
+					if (found != current.end())
+					{
+						// a kept socket never stops listening, listen() again only resizes its backlog
+						applyListenOptions(found->second, key, options);
+						listen(found->second, options.backlog > 0 ? options.backlog : getDefaultBacklog());
+						listeners[key] = found->second;
+						continue;
+					}
+					// a unix path binds once, every loop accepts on the first loop's socket
+					found = shared.find(key);
+					if (found != shared.end() && port == 0)
 					{
-						close(fd);
-						throw std::runtime_error("Failed to add socket to epoll for " + host + ":" + Utils::toString(port));
+						listeners[key] = found->second;
+						continue;
 					}
-					host_port_fd[host][port] = fd;
-					_serverFds.push_back(fd);
 
-					LOG_INFO("servser " + Utils::toString(i) + " Listening on " + host + ":" + Utils::toString(port) + " (fd " + Utils::toString(fd) + ")");
+					int fd = createAndBindSocket(host, port, reusePort, options);
+					if (fd < 0)
+						throw std::runtime_error("Failed to bind socket for " + key);
+					listeners[key] = fd;
+
+					if (verbose)
+						LOG_INFO("servser " + Utils::toString(i) + " Listening on " + key + " (fd " + Utils::toString(fd) + ")");
 				}
 			}
 		}
-		catch (const std::exception& e)
-		{
-			LOG_ERROR(e.what());
-			return false;
-		}
+	}
+	catch (const std::exception& e)
+	{
+		LOG_ERROR(e.what());
+		std::vector<ListenerMap> keep;
+		keep.push_back(current);
+		keep.push_back(shared);
+		closeUnused(collectFds(std::vector<ListenerMap>(1, listeners)), keep, true);
+		listeners.clear();
+		return false;
 	}
 	return true;
 }
 
+std::set<int> ServerManager::collectFds(const std::vector<ListenerMap>& listeners)
+{
+	std::set<int> fds;
 
-void ServerManager::run()
+	for (size_t i = 0; i < listeners.size(); ++i)
+		for (ListenerMap::const_iterator it = listeners[i].begin(); it != listeners[i].end(); ++it)
+			fds.insert(it->second);
+	return fds;
+}
+
+void ServerManager::closeUnused(const std::set<int>& fds, const std::vector<ListenerMap>& keep, bool removeFiles)
 {
-	_running = true;
-	while (_running) 
+	// loops may share a socket, so every descriptor is closed exactly once
+	std::set<int> used = collectFds(keep);
+	std::string host;
+	uint16_t port;
+
+	for (std::set<int>::const_iterator it = fds.begin(); it != fds.end(); ++it)
 	{
-		try {
-			int numEvents = _epoll.wait(1000);
+		if (used.count(*it))
+			continue;
+		if (removeFiles && Utils::getSocketAddress(*it, host, port) && host.compare(0, 5, "unix:") == 0)
+			unlink(host.c_str() + 5);
+		close(*it);
+	}
+}
 
-			if (numEvents < 0) 
+std::vector<int> ServerManager::getListenerFds(const ListenerMap& listeners)
+{
+	std::vector<int> fds;
+
+	for (ListenerMap::const_iterator it = listeners.begin(); it != listeners.end(); ++it)
+		fds.push_back(it->second);
+	return fds;
+}
+
+std::string ServerManager::getListenerKey(int fd)
+{
+	int listening = 0;
+	socklen_t optionLength = sizeof(listening);
+	std::string host;
+	uint16_t port;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optionLength) == -1 || !listening)
+		return "";
+	if (!Utils::getSocketAddress(fd, host, port))
+		return "";
+	return Utils::getListenKey(host, port);
+}
+
+std::set<int> ServerManager::adoptListeners(std::vector<ListenerMap>& inherited)
+{
+	std::map<std::string, std::vector<int> > sockets;
+	std::set<int> adopted;
+	const char* fds = getenv(LISTEN_FDS_ENV);
+	const char* parent = getenv(UPGRADE_PID_ENV);
+
+	if (parent)
+		_upgradeParent = std::atoi(parent);
+	if (fds)
+	{
+		std::stringstream stream(fds);
+		std::string item;
+		while (std::getline(stream, item, ';'))
+		{
+			int fd = std::atoi(item.c_str());
+			std::string key = item.empty() ? "" : getListenerKey(fd);
+			if (key.empty())
 			{
-				if (errno == EINTR)
-					continue;
-				else 
-					throw std::runtime_error("epoll_wait failed");
+				LOG_WARN("Ignoring inherited fd " + item + ": not a listening socket");
+				continue;
 			}
-			for (int i = 0; i < numEvents; ++i) 
-				handleEvent(_epoll.getEvent(i));
-			checkTimeouts();
-		}
-		catch (const std::exception& e) 
-		{
-			LOG_ERROR("ERROR in main event loop " + std::string(e.what()));
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			sockets[key].push_back(fd);
+			adopted.insert(fd);
+			LOG_INFO("Inherited listener " + key + " (fd " + Utils::toString(fd) + ")");
 		}
 	}
-
+	unsetenv(LISTEN_FDS_ENV);
+	unsetenv(UPGRADE_PID_ENV);
+
+	// with fewer inherited sockets than loops, loops share them
+	std::map<std::string, std::vector<int> >::const_iterator it;
+	for (it = sockets.begin(); it != sockets.end(); ++it)
+		for (size_t i = 0; i < inherited.size(); ++i)
+			inherited[i][it->first] = it->second[i % it->second.size()];
+	return adopted;
 }
 
-void ServerManager::stop()
+// every loop builds its own contexts, a bad certificate is caught here before any loop sees it
+bool ServerManager::checkCertificates(const std::vector<ServerConfig>& servers)
 {
-	_running = false;
+	VhostQuota::Table* usage = new VhostQuota::Table(servers.size());
+	try
+	{
+		ServerSet check(servers, usage);
+	}
+	catch (const std::exception& e)
+	{
+		usage->release();
+		LOG_ERROR(e.what());
+		return false;
+	}
+	usage->release();
+	return true;
 }
 
-void ServerManager::handleEvent(const epoll_event& event)
+bool ServerManager::init()
 {
-	int fd = event.data.fd;
-	uint32_t events = event.events;
+	bool reusePort = _workerThreads > 1;
+	if (!checkCertificates(_servers))
+		return false;
+	std::vector<ListenerMap> inherited(_workerThreads);
+	std::set<int> adopted = adoptListeners(inherited);
+
+	_loopListeners.resize(_workerThreads);
+	for (size_t i = 0; i < _workerThreads; ++i)
+		if (!bindListeners(_servers, inherited[i], i ? _loopListeners[0] : ListenerMap(), _loopListeners[i], reusePort, i == 0))
+			return false;
+	closeUnused(adopted, _loopListeners, false);
+
+	if (_workerProcesses > 1)
+		return true;
+	return startLoops();
+}
 
-	try {
-		if (events & EPOLLHUP)
-			throw std::runtime_error("EPOLL hangup fd " + Utils::toString(fd) + ", events: " + Utils::toString(events));
+bool ServerManager::reloadConfig(std::vector<ListenerMap>& previous)
+{
+	std::vector<ServerConfig> servers;
+	size_t egressRate;
 
-		if (events & EPOLLERR)
-			throw std::runtime_error("EPOLL error fd " + Utils::toString(fd) + ", events: " + Utils::toString(events));
+	LOG_INFO("Reloading configuration from " + _configFile);
+	try
+	{
+		ServerConfig config(_configFile);
+		servers = config.getServers();
+		egressRate = config.getMaxEgressRate();
+		if (config.getWorkerThreads() != _workerThreads || config.getWorkerProcesses() != _workerProcesses || config.isEdgeTriggered() != _edgeTriggered)
+			LOG_WARN("worker_threads, worker_processes and edge_triggered only change on restart");
+	}
+	catch (const std::exception& e)
+	{
+		LOG_ERROR("Reload failed, keeping the current configuration: " + std::string(e.what()));
+		return false;
+	}
+	if (!checkCertificates(servers))
+	{
+		LOG_ERROR("Reload failed, keeping the current configuration");
+		return false;
+	}
 
-		if (events & EPOLLIN)
+	std::vector<ListenerMap> listeners(_workerThreads);
+	for (size_t i = 0; i < _workerThreads; ++i)
+	{
+		if (!bindListeners(servers, _loopListeners[i], i ? listeners[0] : ListenerMap(), listeners[i], _workerThreads > 1, i == 0))
 		{
-			if (std::find(_serverFds.begin(), _serverFds.end(), fd) != _serverFds.end())
-				acceptClient(fd);
-
-			if (_clients.find(fd) != _clients.end())
-			{	
-				_clients[fd]->updateActivity();
-				_clients[fd]->getRequest()->setClientfd(fd);
-				_clients[fd]->readRequest();
-				if (_clients[fd]->getRequest()->isComplete()) 
-				{
-					_clients[fd]->getResponse()->buildResponse();
-					if (!_epoll.modify(fd, EPOLLOUT)) 
-						throw std::runtime_error("Failed to modify epoll to EPOLLOUT");
-				}
-			}
+			closeUnused(collectFds(listeners), _loopListeners, true);
+			LOG_ERROR("Reload failed, keeping the current configuration");
+			return false;
 		}
+	}
 
-		if (events & EPOLLOUT)
-		{
-			_clients[fd]->updateActivity();
-			if (_clients[fd]->getResponse()->isReady())
-				_clients[fd]->sendResponse();
-			if (_clients[fd]->getResponse()->isComplete())
-			{
-				if (!_epoll.modify(fd, EPOLLIN))
-					throw std::runtime_error("Failed to modify epoll to EPOLLIN");
+	_servers = servers;
+	if (egressRate != _maxEgressRate)
+		_egress->configure(egressRate, TimerWheel::now());
+	_maxEgressRate = egressRate;
+	previous.swap(_loopListeners);
+	_loopListeners.swap(listeners);
+	return true;
+}
 
-				if(_clients[fd]->shouldKeepAlive())
-					_clients[fd]->reset();
-				else 
-					cleanupClient(fd);
+bool ServerManager::startLoops()
+{
+	uint32_t listenEvents = EPOLLIN;
+	if (_workerProcesses > 1)
+		listenEvents |= EPOLLEXCLUSIVE;
 
-			}
+	VhostQuota::Table* usage = new VhostQuota::Table(_servers.size());
+	try
+	{
+		for (size_t i = 0; i < _workerThreads; ++i)
+		{
+			_loops.push_back(new EventLoop(_servers, getListenerFds(_loopListeners[i]), listenEvents, _edgeTriggered, usage, &_limiter, _egress));
+			_loops.back()->setIndex(i);
+		}
+		// every worker process gets its own socket, commands act on the process that receives them
+		if (!_adminSocket.empty())
+		{
+			if (_workerSlot >= 0)
+				_admin = new AdminServer(_adminSocket + "." + Utils::toString(_workerSlot), _loops, getppid());
+			else
+				_admin = new AdminServer(_adminSocket, _loops, getpid());
 		}
 	}
-	catch (const std::exception& e) 
+	catch (const std::exception& e)
 	{
+		usage->release();
 		LOG_ERROR(e.what());
-		cleanupClient(fd);
+		return false;
 	}
+	usage->release();
+	LOG_INFO("Running " + Utils::toString(_workerThreads) + " event loop(s) on " + _loops[0]->getBackendName() + (_edgeTriggered ? " (edge-triggered)" : ""));
+	return true;
 }
 
-
-
-void ServerManager::acceptClient(int fd) 
+void* ServerManager::runLoop(void* loop)
 {
-	struct sockaddr_in clientAddr;
-	socklen_t clientAddrLen = sizeof(clientAddr);
+	static_cast<EventLoop*>(loop)->run();
+	return NULL;
+}
 
-	int clientFd = accept(fd, (struct sockaddr *)&clientAddr, &clientAddrLen);
+void ServerManager::run()
+{
+	_running = true;
+	if (_workerProcesses > 1)
+		superviseWorkers();
+	else
+		runLoops();
+}
 
-	if (clientFd == -1) 
+void ServerManager::runLoops()
+{
+	if (_loops.empty())
 		return;
-	
-	char client_ip[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &(clientAddr.sin_addr), client_ip, INET_ADDRSTRLEN);
-	int client_port = ntohs(clientAddr.sin_port);
-	LOG_INFO(std::string("Client connected from ") + client_ip + ":" + Utils::toString(client_port) + " (fd " + Utils::toString(clientFd) + ")");
 
-	if (_clients.size() >= CLIENTS)
+	sigset_t blocked, previous;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGHUP);
+	sigaddset(&blocked, SIGQUIT);
+	sigaddset(&blocked, SIGUSR2);
+	sigaddset(&blocked, SIGCHLD);
+	signal(SIGCHLD, wakeSupervisor);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+	for (size_t i = 0; i < _loops.size(); ++i)
 	{
-		close(clientFd);
-		return;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, runLoop, _loops[i]) != 0)
+		{
+			LOG_ERROR("Failed to start event loop thread " + Utils::toString(i));
+			stop();
+			break;
+		}
+		_threads.push_back(thread);
 	}
 
-	if (fcntl(clientFd, F_SETFL, O_NONBLOCK) == -1) 
+	if (_running)
+		notifyUpgrade();
+	// every loop runs on its own thread, the main thread only waits for signals
+	while (_running && !_drainRequested)
 	{
-		close(clientFd);
-		return;
+		int status;
+		if (_upgradePid > 0 && waitpid(_upgradePid, &status, WNOHANG) == _upgradePid)
+			reapUpgrade(_upgradePid, status);
+		else if (_reloadRequested)
+		{
+			_reloadRequested = 0;
+			reloadLoops();
+		}
+		else if (_upgradeRequested)
+		{
+			_upgradeRequested = 0;
+			upgradeBinary();
+		}
+		else
+			sigsuspend(&previous);
 	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
 
-	try 
+	if (_running && _drainRequested)
 	{
-		Client* client = new Client(clientFd, _servers);
+		LOG_INFO("Graceful shutdown, waiting for open connections");
+		for (size_t i = 0; i < _loops.size(); ++i)
+			_loops[i]->drain();
+	}
+	else
+		stop();
+	for (size_t i = 0; i < _threads.size(); ++i)
+		pthread_join(_threads[i], NULL);
+	_threads.clear();
+}
 
-		_clients[clientFd] = client;
-		if (!_epoll.add(clientFd, EPOLLIN)) 
-		{
-			delete client;
-			close(clientFd);
-			return;
-		}
-	} 
+void ServerManager::reloadLoops()
+{
+	std::vector<ListenerMap> previous;
+
+	if (!reloadConfig(previous))
+		return;
 
-	catch (const std::exception& e) 
+	// the loops take their own references to the counters when they apply the reload
+	VhostQuota::Table* usage = new VhostQuota::Table(_servers.size());
+	for (size_t i = 0; i < _loops.size(); ++i)
+		_loops[i]->reload(_servers, getListenerFds(_loopListeners[i]), usage);
+	// removed sockets are closed only once no loop polls them any more
+	for (size_t i = 0; i < _loops.size(); ++i)
+		_loops[i]->waitReload();
+	usage->release();
+	closeUnused(collectFds(previous), _loopListeners, true);
+	LOG_INFO("Configuration reloaded");
+}
+
+pid_t ServerManager::spawnWorker(size_t slot)
+{
+	pid_t pid = fork();
+	if (pid < 0)
 	{
-		LOG_DEBUG(e.what());
-		close(clientFd);
+		LOG_ERROR("Failed to fork worker " + Utils::toString(slot) + ": " + std::string(strerror(errno)));
+		return -1;
+	}
+	if (pid == 0)
+	{
+		sigset_t empty;
+		sigemptyset(&empty);
+		pthread_sigmask(SIG_SETMASK, &empty, NULL);
+		// reloads and upgrades are driven by the master, a worker only drains or stops
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGUSR2, SIG_IGN);
+		signal(SIGCHLD, SIG_DFL);
+		_workers.clear();
+		_retiring.clear();
+		_upgradePid = -1;
+		_upgradeParent = -1;
+		_workerSlot = slot;
+		_workerProcesses = 1;
+		return 0;
 	}
+	_workers[slot] = pid;
+	_spawnTimes[slot] = time(NULL);
+	LOG_INFO("Started worker " + Utils::toString(slot) + " (pid " + Utils::toString(pid) + ")");
+	return pid;
+}
+
+void ServerManager::runWorker()
+{
+	if (startLoops())
+		runLoops();
 }
 
-void ServerManager::checkTimeouts()
+pid_t ServerManager::reloadWorkers()
 {
-	time_t currentTime = time(NULL);
+	std::vector<ListenerMap> previous;
 
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); )
+	if (!reloadConfig(previous))
+		return -1;
+	// old workers keep their own copies of removed sockets until they exit
+	closeUnused(collectFds(previous), _loopListeners, true);
+
+	std::vector<pid_t> old;
+	for (size_t i = 0; i < _workers.size(); ++i)
+		if (_workers[i] > 0)
+			old.push_back(_workers[i]);
+
+	// the new generation is accepting before the old one stops
+	for (size_t i = 0; i < _workers.size(); ++i)
+		if (spawnWorker(i) == 0)
+			return 0;
+	for (size_t i = 0; i < old.size(); ++i)
+	{
+		kill(old[i], SIGQUIT);
+		_retiring.push_back(old[i]);
+	}
+	LOG_INFO("Configuration reloaded, retiring " + Utils::toString(old.size()) + " worker(s)");
+	return 1;
+}
+
+void ServerManager::superviseWorkers()
+{
+	sigset_t blocked, previous;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGHUP);
+	sigaddset(&blocked, SIGQUIT);
+	sigaddset(&blocked, SIGUSR2);
+	sigaddset(&blocked, SIGCHLD);
+	signal(SIGCHLD, wakeSupervisor);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+	_workers.assign(_workerProcesses, -1);
+	_spawnTimes.assign(_workerProcesses, 0);
+	for (size_t i = 0; i < _workers.size(); ++i)
+		if (spawnWorker(i) == 0)
+			return runWorker();
+	notifyUpgrade();
+
+	bool draining = false;
+	while (_running)
 	{
-		if ((currentTime - it->second->getLastActivity()) >= TIMEOUT)
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0 && errno != ECHILD)
 		{
-			int fd = it->first;
-			LOG_DEBUG("Client timed out  " + Utils::toString(fd));
+			LOG_ERROR("waitpid failed: " + std::string(strerror(errno)));
+			break;
+		}
+		if (pid <= 0)
+		{
+			// an upgraded master is our child as well, so running out of workers ends the drain
+			if (draining && _retiring.empty() && std::count(_workers.begin(), _workers.end(), -1) == static_cast<std::ptrdiff_t>(_workers.size()))
+				break;
+			if (_drainRequested && !draining)
+			{
+				draining = true;
+				LOG_INFO("Graceful shutdown, draining workers");
+				for (size_t i = 0; i < _workers.size(); ++i)
+					if (_workers[i] > 0)
+						kill(_workers[i], SIGQUIT);
+			}
+			else if (_reloadRequested && !draining)
+			{
+				_reloadRequested = 0;
+				if (reloadWorkers() == 0)
+					return runWorker();
+			}
+			else if (_upgradeRequested && !draining)
+			{
+				_upgradeRequested = 0;
+				upgradeBinary();
+			}
+			else
+				sigsuspend(&previous);
+			continue;
+		}
 
-			cleanupClient(fd);
+		if (pid == _upgradePid)
+		{
+			reapUpgrade(pid, status);
+			continue;
+		}
 
-			it = _clients.begin();
+		size_t slot = 0;
+		while (slot < _workers.size() && _workers[slot] != pid)
+			++slot;
+		if (slot == _workers.size())
+		{
+			for (size_t i = 0; i < _retiring.size(); ++i)
+			{
+				if (_retiring[i] == pid)
+				{
+					_retiring.erase(_retiring.begin() + i);
+					break;
+				}
+			}
+			LOG_INFO("Retired worker (pid " + Utils::toString(pid) + ") exited");
+			continue;
 		}
+		_workers[slot] = -1;
+
+		if (WIFSIGNALED(status))
+			LOG_ERROR("Worker " + Utils::toString(slot) + " (pid " + Utils::toString(pid) + ") killed by signal " + Utils::toString(WTERMSIG(status)));
+		else if (draining)
+			LOG_INFO("Worker " + Utils::toString(slot) + " (pid " + Utils::toString(pid) + ") drained");
 		else
-			++it;
+			LOG_WARN("Worker " + Utils::toString(slot) + " (pid " + Utils::toString(pid) + ") exited with status " + Utils::toString(WEXITSTATUS(status)));
+
+		if (!_running || draining)
+			continue;
+		if (time(NULL) - _spawnTimes[slot] < 1)
+			sleep(1);
+		if (spawnWorker(slot) == 0)
+			return runWorker();
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	for (size_t i = 0; i < _workers.size(); ++i)
+		if (_workers[i] > 0)
+			kill(_workers[i], SIGTERM);
+	for (size_t i = 0; i < _retiring.size(); ++i)
+		kill(_retiring[i], SIGTERM);
+	for (size_t i = 0; i < _workers.size(); ++i)
+		if (_workers[i] > 0)
+			waitpid(_workers[i], NULL, 0);
+	for (size_t i = 0; i < _retiring.size(); ++i)
+		waitpid(_retiring[i], NULL, 0);
+	_workers.clear();
+	_retiring.clear();
+}
+
+void ServerManager::stop()
+{
+	_running = false;
+	for (size_t i = 0; i < _loops.size(); ++i)
+		_loops[i]->stop();
+}
+
+void ServerManager::requestReload()
+{
+	_reloadRequested = 1;
+}
+
+void ServerManager::requestDrain()
+{
+	_drainRequested = 1;
+}
+
+void ServerManager::requestUpgrade()
+{
+	_upgradeRequested = 1;
+}
+
+void ServerManager::setArguments(char* argv[])
+{
+	_arguments.clear();
+	for (size_t i = 0; argv[i]; ++i)
+		_arguments.push_back(argv[i]);
+}
+
+void ServerManager::upgradeBinary()
+{
+	if (_upgradePid > 0)
+	{
+		LOG_WARN("Binary upgrade already in progress (pid " + Utils::toString(_upgradePid) + ")");
+		return;
+	}
+
+	std::set<int> fds = collectFds(_loopListeners);
+	std::string listenFds = LISTEN_FDS_ENV "=";
+	for (std::set<int>::const_iterator it = fds.begin(); it != fds.end(); ++it)
+		listenFds += Utils::toString(*it) + ";";
+	std::string parentPid = UPGRADE_PID_ENV "=" + Utils::toString(getpid());
+
+	// everything exec needs is built before fork, the child of a threaded process must not allocate
+	std::vector<char*> env;
+	for (char** variable = environ; *variable; ++variable)
+		if (std::strncmp(*variable, LISTEN_FDS_ENV "=", sizeof(LISTEN_FDS_ENV)) != 0 && std::strncmp(*variable, UPGRADE_PID_ENV "=", sizeof(UPGRADE_PID_ENV)) != 0)
+			env.push_back(*variable);
+	env.push_back(&listenFds[0]);
+	env.push_back(&parentPid[0]);
+	env.push_back(NULL);
+	std::vector<char*> argv;
+	for (size_t i = 0; i < _arguments.size(); ++i)
+		argv.push_back(&_arguments[i][0]);
+	argv.push_back(NULL);
+	std::vector<int> inherited(fds.begin(), fds.end());
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		LOG_ERROR("Binary upgrade failed: fork: " + std::string(strerror(errno)));
+		return;
+	}
+	if (pid == 0)
+	{
+		sigset_t empty;
+		sigemptyset(&empty);
+		pthread_sigmask(SIG_SETMASK, &empty, NULL);
+		for (size_t i = 0; i < inherited.size(); ++i)
+			fcntl(inherited[i], F_SETFD, 0);
+		environ = &env[0];
+		execvp(argv[0], &argv[0]);
+		_exit(127);
 	}
+	_upgradePid = pid;
+	LOG_INFO("Started " + _arguments[0] + " (pid " + Utils::toString(pid) + ") with " + Utils::toString(inherited.size()) + " listener(s), draining once it is ready");
 }
 
-void ServerManager::cleanupClient(int fd)
+void ServerManager::reapUpgrade(pid_t pid, int status)
 {
-	std::map<int, Client*>::iterator it = _clients.find(fd);
+	_upgradePid = -1;
+	if (WIFSIGNALED(status))
+		LOG_ERROR("New binary (pid " + Utils::toString(pid) + ") killed by signal " + Utils::toString(WTERMSIG(status)) + ", upgrade aborted");
+	else
+		LOG_ERROR("New binary (pid " + Utils::toString(pid) + ") exited with status " + Utils::toString(WEXITSTATUS(status)) + ", upgrade aborted");
+}
 
-	if (it != _clients.end()) 
+void ServerManager::notifyUpgrade()
+{
+	// the old binary drains only once this one is accepting on the inherited sockets
+	if (_upgradeParent > 0 && _upgradeParent == getppid())
 	{
-		_epoll.remove(fd);
-		delete it->second;
-		_clients.erase(it);
-		close(fd);
-		LOG_DEBUG("Client disconnected  " + Utils::toString(fd));
+		LOG_INFO("Taking over from pid " + Utils::toString(_upgradeParent));
+		kill(_upgradeParent, SIGQUIT);
 	}
+	_upgradeParent = -1;
 }
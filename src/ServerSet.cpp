@@ -0,0 +1,62 @@
+#include "../include/ServerSet.hpp"
+
+ServerSet::ServerSet(const std::vector<ServerConfig>& configs, VhostQuota::Table* usage)
+	: servers(configs),
+	quota(servers, usage),
+	clients(0)
+{
+	try
+	{
+		configureListeners();
+	}
+	catch (...)
+	{
+		for (std::map<std::string, TlsContext*>::iterator it = tls.begin(); it != tls.end(); ++it)
+			delete it->second;
+		throw;
+	}
+}
+
+ServerSet::~ServerSet()
+{
+	for (std::map<std::string, TlsContext*>::iterator it = tls.begin(); it != tls.end(); ++it)
+		delete it->second;
+}
+
+// ssl or http2 on any listen of an address turns it on for every server sharing that address
+void ServerSet::configureListeners()
+{
+	std::map<std::string, std::vector<const ServerConfig*> > listeners;
+	std::map<std::string, bool> ssl;
+
+	for (size_t i = 0; i < servers.size(); ++i)
+	{
+		const std::map<std::string, std::vector<uint16_t> >& hostPorts = servers[i].getHostPort();
+		for (std::map<std::string, std::vector<uint16_t> >::const_iterator it = hostPorts.begin(); it != hostPorts.end(); ++it)
+		{
+			for (size_t j = 0; j < it->second.size(); ++j)
+			{
+				std::string key = Utils::getListenKey(it->first, it->second[j]);
+				listeners[key].push_back(&servers[i]);
+				const ListenOptions& options = servers[i].getListenOptions(it->first, it->second[j]);
+				if (options.ssl)
+					ssl[key] = true;
+				if (options.http2)
+					http2.insert(key);
+			}
+		}
+	}
+	for (std::map<std::string, bool>::const_iterator it = ssl.begin(); it != ssl.end(); ++it)
+		tls[it->first] = new TlsContext(listeners[it->first], http2.count(it->first) > 0);
+}
+
+TlsContext* ServerSet::getTlsContext(const std::string& listenKey) const
+{
+	std::map<std::string, TlsContext*>::const_iterator it = tls.find(listenKey);
+	return it == tls.end() ? NULL : it->second;
+}
+
+bool ServerSet::hasHttp2(const std::string& listenKey) const
+{
+	return http2.count(listenKey) > 0;
+}
@@ -0,0 +1,174 @@
+#include "../include/TimerWheel.hpp"
+#include <climits>
+#include <time.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+TimerWheel::Timer::Timer() : prev(NULL), next(NULL), expires(0), data(NULL)
+{
+}
+
+bool TimerWheel::Timer::isPending() const
+{
+	return next != NULL;
+}
+
+TimerWheel::TimerWheel(unsigned tickMs) : _tick(tickMs ? tickMs : 1), _count(0)
+{
+	for (unsigned level = 0; level < TIMER_LEVELS; ++level)
+	{
+		for (unsigned slot = 0; slot < TIMER_SLOTS; ++slot)
+		{
+			_slots[level][slot].prev = &_slots[level][slot];
+			_slots[level][slot].next = &_slots[level][slot];
+		}
+	}
+	_current = now() / _tick;
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+uint64_t TimerWheel::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+size_t TimerWheel::size() const
+{
+	return _count;
+}
+
+void TimerWheel::link(Timer* head, Timer* timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+void TimerWheel::unlink(Timer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+void TimerWheel::place(Timer* timer, uint64_t ticks)
+{
+	uint64_t delta = ticks - _current;
+	unsigned level = 0;
+
+	while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+		++level;
+	if (delta >= (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+		ticks = _current + (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+
+	link(&_slots[level][(ticks >> (TIMER_SLOT_BITS * level)) & TIMER_MASK], timer);
+}
+
+void TimerWheel::schedule(Timer* timer, uint64_t expires)
+{
+	if (timer->isPending())
+	{
+		unlink(timer);
+		--_count;
+	}
+
+	uint64_t ticks = (expires + _tick - 1) / _tick;
+	if (ticks <= _current)
+		ticks = _current + 1;
+	timer->expires = expires;
+	place(timer, ticks);
+	++_count;
+}
+
+void TimerWheel::cancel(Timer* timer)
+{
+	if (!timer->isPending())
+		return;
+	unlink(timer);
+	--_count;
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+	if (level >= TIMER_LEVELS)
+		return;
+
+	unsigned index = (_current >> (TIMER_SLOT_BITS * level)) & TIMER_MASK;
+	Timer* head = &_slots[level][index];
+	while (head->next != head)
+	{
+		Timer* timer = head->next;
+		unlink(timer);
+		place(timer, (timer->expires + _tick - 1) / _tick);
+	}
+	if (index == 0)
+		cascade(level + 1);
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer*>& expired)
+{
+	uint64_t target = now / _tick;
+
+	if (_count == 0)
+	{
+		if (target > _current)
+			_current = target;
+		return;
+	}
+
+	while (_current < target && _count > 0)
+	{
+		++_current;
+		unsigned index = _current & TIMER_MASK;
+		if (index == 0)
+			cascade(1);
+
+		Timer* head = &_slots[0][index];
+		while (head->next != head)
+		{
+			Timer* timer = head->next;
+			unlink(timer);
+			--_count;
+			expired.push_back(timer);
+		}
+	}
+	if (_current < target)
+		_current = target;
+}
+
+int TimerWheel::nextTimeout(uint64_t now) const
+{
+	if (_count == 0)
+		return -1;
+
+	uint64_t next = ~0ULL;
+	for (unsigned level = 0; level < TIMER_LEVELS; ++level)
+	{
+		unsigned shift = TIMER_SLOT_BITS * level;
+		uint64_t base = _current >> shift;
+		for (uint64_t k = 1; k <= TIMER_SLOTS; ++k)
+		{
+			const Timer* head = &_slots[level][(base + k) & TIMER_MASK];
+			if (head->next != head)
+			{
+				if (((base + k) << shift) < next)
+					next = (base + k) << shift;
+				break;
+			}
+		}
+	}
+
+	uint64_t when = next * _tick;
+	if (when <= now)
+		return 0;
+	if (when - now > static_cast<uint64_t>(INT_MAX))
+		return INT_MAX;
+	return static_cast<int>(when - now);
+}
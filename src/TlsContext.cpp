@@ -0,0 +1,267 @@
+#include "../include/TlsContext.hpp"
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <ctime>
+#include <stdexcept>
+
+#define TICKET_SECRET_SIZE 32
+#define TICKET_NAME_SIZE 16
+#define TICKET_KEY_SIZE 32
+
+static unsigned char ticketSecret[TICKET_SECRET_SIZE];
+static bool ticketSecretReady = false;
+static pthread_once_t ticketSecretOnce = PTHREAD_ONCE_INIT;
+
+static void generateTicketSecret()
+{
+	ticketSecretReady = RAND_bytes(ticketSecret, sizeof(ticketSecret)) == 1;
+}
+
+// one key per rotation period, derived from the secret so every loop and worker agrees without talking
+static void deriveTicketKey(uint64_t period, unsigned char label, unsigned char* key)
+{
+	unsigned char message[9];
+	unsigned int length = TICKET_KEY_SIZE;
+
+	for (size_t i = 0; i < 8; ++i)
+		message[i] = static_cast<unsigned char>(period >> (56 - 8 * i));
+	message[8] = label;
+	HMAC(EVP_sha256(), ticketSecret, sizeof(ticketSecret), message, sizeof(message), key, &length);
+}
+
+// the period in clear followed by a tag, so a ticket names the key it was sealed with
+static void getTicketName(uint64_t period, unsigned char* name)
+{
+	unsigned char tag[TICKET_KEY_SIZE];
+
+	deriveTicketKey(period, 'n', tag);
+	for (size_t i = 0; i < 8; ++i)
+		name[i] = static_cast<unsigned char>(period >> (56 - 8 * i));
+	for (size_t i = 8; i < TICKET_NAME_SIZE; ++i)
+		name[i] = tag[i - 8];
+}
+
+// the master calls this before forking, so a ticket resumes on any loop or worker
+void TlsContext::initTicketKeys()
+{
+	pthread_once(&ticketSecretOnce, generateTicketSecret);
+	if (!ticketSecretReady)
+		throw std::runtime_error("Failed to generate session ticket secret: " + getError());
+}
+
+TlsContext::TlsContext(const std::vector<const ServerConfig*>& servers, bool http2) : _default(NULL)
+{
+	std::map<std::string, SSL_CTX*> loaded;
+
+	try
+	{
+		for (size_t i = 0; i < servers.size(); ++i)
+		{
+			const std::string& certificate = servers[i]->getSslCertificate();
+			if (certificate.empty())
+				continue;
+
+			std::string files = certificate + "\n" + servers[i]->getSslCertificateKey();
+			if (!loaded.count(files))
+				loaded[files] = createContext(certificate, servers[i]->getSslCertificateKey(), http2);
+			if (!_default)
+				_default = loaded[files];
+			if (!_names.count(servers[i]->getServerName()))
+				_names[servers[i]->getServerName()] = loaded[files];
+		}
+		if (!_default)
+			throw std::runtime_error("no ssl_certificate for ssl listener");
+	}
+	catch (...)
+	{
+		for (size_t i = 0; i < _contexts.size(); ++i)
+			SSL_CTX_free(_contexts[i]);
+		throw;
+	}
+}
+
+TlsContext::~TlsContext()
+{
+	// live sessions hold their own reference to the context they use
+	for (size_t i = 0; i < _contexts.size(); ++i)
+		SSL_CTX_free(_contexts[i]);
+}
+
+SSL_CTX* TlsContext::createContext(const std::string& certificate, const std::string& key, bool http2)
+{
+	initTicketKeys();
+	SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+
+	if (!context)
+		throw std::runtime_error("SSL_CTX_new failed: " + getError());
+	_contexts.push_back(context);
+
+	if (SSL_CTX_use_certificate_chain_file(context, certificate.c_str()) != 1)
+		throw std::runtime_error("Failed to load certificate " + certificate + ": " + getError());
+	if (SSL_CTX_use_PrivateKey_file(context, key.c_str(), SSL_FILETYPE_PEM) != 1)
+		throw std::runtime_error("Failed to load certificate key " + key + ": " + getError());
+	if (SSL_CTX_check_private_key(context) != 1)
+		throw std::runtime_error("Certificate key " + key + " does not match " + certificate);
+
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+	options |= SSL_OP_ENABLE_KTLS;
+#endif
+	SSL_CTX_set_options(context, options);
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	// a per loop session cache would miss on every other loop, resumption relies on tickets alone
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_timeout(context, TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_session_id_context(context, reinterpret_cast<const unsigned char*>("webserv"), 7);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (SSL_CTX_set_tlsext_ticket_key_evp_cb(context, handleTicket) != 1)
+#else
+	if (SSL_CTX_set_tlsext_ticket_key_cb(context, handleTicket) != 1)
+#endif
+		throw std::runtime_error("Failed to set session ticket callback: " + getError());
+
+	SSL_CTX_set_tlsext_servername_callback(context, selectServer);
+	SSL_CTX_set_tlsext_servername_arg(context, this);
+	if (http2)
+		SSL_CTX_set_alpn_select_cb(context, selectProtocol, NULL);
+	return context;
+}
+
+int TlsContext::selectServer(SSL* ssl, int* alert, void* arg)
+{
+	const TlsContext* self = static_cast<const TlsContext*>(arg);
+	const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	(void) alert;
+	if (!name)
+		return SSL_TLSEXT_ERR_OK;
+	std::map<std::string, SSL_CTX*>::const_iterator it = self->_names.find(name);
+	if (it != self->_names.end() && it->second != SSL_get_SSL_CTX(ssl))
+		SSL_set_SSL_CTX(ssl, it->second);
+	return SSL_TLSEXT_ERR_OK;
+}
+
+// h2 wins when the client offers it, a client without ALPN simply gets HTTP/1.1
+int TlsContext::selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* outLength, const unsigned char* in, unsigned int inLength, void* arg)
+{
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+	unsigned char* selected;
+
+	(void) ssl;
+	(void) arg;
+	if (SSL_select_next_proto(&selected, outLength, protocols, sizeof(protocols) - 1, in, inLength) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+// tickets are sealed with the key of the current period, the previous one still opens them and renews the ticket
+int TlsContext::selectTicketKey(unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, unsigned char* macKey, int encrypt)
+{
+	uint64_t current = static_cast<uint64_t>(time(NULL)) / TLS_TICKET_ROTATION;
+	uint64_t period = current;
+	unsigned char key[TICKET_KEY_SIZE];
+
+	if (encrypt)
+	{
+		getTicketName(period, name);
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+	}
+	else
+	{
+		unsigned char expected[TICKET_NAME_SIZE];
+
+		period = 0;
+		for (size_t i = 0; i < 8; ++i)
+			period = (period << 8) | name[i];
+		if (period != current && period + 1 != current)
+			return 0;
+		getTicketName(period, expected);
+		if (CRYPTO_memcmp(expected, name, TICKET_NAME_SIZE) != 0)
+			return 0;
+	}
+	deriveTicketKey(period, 'c', key);
+	if (EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, key, iv, encrypt) != 1)
+		return -1;
+	deriveTicketKey(period, 'm', macKey);
+	return period == current ? 1 : 2;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TlsContext::handleTicket(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt)
+{
+	unsigned char macKey[TICKET_KEY_SIZE];
+	OSSL_PARAM params[3];
+	int result = selectTicketKey(name, iv, cipher, macKey, encrypt);
+
+	(void) ssl;
+	if (result <= 0)
+		return result;
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, macKey, sizeof(macKey));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(mac, params) != 1)
+		return -1;
+	return result;
+}
+#else
+int TlsContext::handleTicket(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt)
+{
+	unsigned char macKey[TICKET_KEY_SIZE];
+	int result = selectTicketKey(name, iv, cipher, macKey, encrypt);
+
+	(void) ssl;
+	if (result <= 0)
+		return result;
+	if (HMAC_Init_ex(mac, macKey, sizeof(macKey), EVP_sha256(), NULL) != 1)
+		return -1;
+	return result;
+}
+#endif
+
+SSL* TlsContext::createSession(int fd) const
+{
+	SSL* ssl = SSL_new(_default);
+
+	if (!ssl)
+		return NULL;
+	if (SSL_set_fd(ssl, fd) != 1)
+	{
+		SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+	return ssl;
+}
+
+std::string TlsContext::getError()
+{
+	unsigned long code = ERR_get_error();
+	char buffer[256];
+
+	if (code == 0)
+		return "unknown error";
+	ERR_error_string_n(code, buffer, sizeof(buffer));
+	ERR_clear_error();
+	return buffer;
+}
+
+bool TlsContext::hasKernelTls(SSL* ssl)
+{
+#ifdef BIO_get_ktls_send
+	return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+	(void) ssl;
+	return false;
+#endif
+}
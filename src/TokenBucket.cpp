@@ -0,0 +1,106 @@
+#include "../include/TokenBucket.hpp"
+#include "../include/ServerConfig.hpp"
+
+// tokens are kept in byte-milliseconds so refills at any rate stay exact
+TokenBucket::TokenBucket() : _rate(0), _capacity(0), _tokens(0), _updated(0)
+{
+}
+
+TokenBucket::~TokenBucket()
+{
+}
+
+// the egress bucket is shared by every loop and worker, so all fields are only touched atomically
+void TokenBucket::configure(size_t bytesPerSecond, uint64_t now)
+{
+	uint64_t burst = static_cast<uint64_t>(bytesPerSecond) * RATE_LIMIT_BURST_MS / 1000;
+	uint64_t capacity = (burst > 0 ? burst : 1) * 1000;
+
+	__atomic_store_n(&_capacity, capacity, __ATOMIC_RELAXED);
+	__atomic_store_n(&_tokens, capacity, __ATOMIC_RELAXED);
+	__atomic_store_n(&_updated, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&_rate, bytesPerSecond, __ATOMIC_RELEASE);
+}
+
+bool TokenBucket::isLimited() const
+{
+	return __atomic_load_n(&_rate, __ATOMIC_ACQUIRE) > 0;
+}
+
+// whoever moves the timestamp credits the elapsed time, so no interval is counted twice
+void TokenBucket::refill(uint64_t now)
+{
+	uint64_t updated = __atomic_load_n(&_updated, __ATOMIC_RELAXED);
+
+	if (now <= updated || !__atomic_compare_exchange_n(&_updated, &updated, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	uint64_t elapsed = now - updated;
+	if (elapsed > 1000)
+		elapsed = 1000;
+	uint64_t added = elapsed * __atomic_load_n(&_rate, __ATOMIC_RELAXED);
+	uint64_t capacity = __atomic_load_n(&_capacity, __ATOMIC_RELAXED);
+	uint64_t tokens = __atomic_load_n(&_tokens, __ATOMIC_RELAXED);
+	uint64_t filled;
+	do
+		filled = tokens + added < capacity ? tokens + added : capacity;
+	while (!__atomic_compare_exchange_n(&_tokens, &tokens, filled, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+size_t TokenBucket::available(uint64_t now)
+{
+	refill(now);
+	return static_cast<size_t>(__atomic_load_n(&_tokens, __ATOMIC_RELAXED) / 1000);
+}
+
+void TokenBucket::consume(size_t bytes)
+{
+	uint64_t amount = static_cast<uint64_t>(bytes) * 1000;
+	uint64_t tokens = __atomic_load_n(&_tokens, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&_tokens, &tokens, tokens > amount ? tokens - amount : 0, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+size_t TokenBucket::take(size_t bytes, uint64_t now)
+{
+	size_t granted;
+
+	refill(now);
+	uint64_t tokens = __atomic_load_n(&_tokens, __ATOMIC_RELAXED);
+	do
+	{
+		granted = static_cast<size_t>(tokens / 1000);
+		if (granted > bytes)
+			granted = bytes;
+		if (granted == 0)
+			return 0;
+	}
+	while (!__atomic_compare_exchange_n(&_tokens, &tokens, tokens - static_cast<uint64_t>(granted) * 1000, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return granted;
+}
+
+void TokenBucket::refund(size_t bytes)
+{
+	uint64_t amount = static_cast<uint64_t>(bytes) * 1000;
+	uint64_t capacity = __atomic_load_n(&_capacity, __ATOMIC_RELAXED);
+	uint64_t tokens = __atomic_load_n(&_tokens, __ATOMIC_RELAXED);
+
+	if (amount == 0)
+		return;
+	while (!__atomic_compare_exchange_n(&_tokens, &tokens, tokens + amount < capacity ? tokens + amount : capacity, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t TokenBucket::waitTime(size_t bytes) const
+{
+	uint64_t needed = static_cast<uint64_t>(bytes) * 1000;
+	uint64_t capacity = __atomic_load_n(&_capacity, __ATOMIC_RELAXED);
+	uint64_t tokens = __atomic_load_n(&_tokens, __ATOMIC_RELAXED);
+	size_t rate = __atomic_load_n(&_rate, __ATOMIC_RELAXED);
+
+	if (needed > capacity)
+		needed = capacity;
+	if (tokens >= needed || rate == 0)
+		return 0;
+	return (needed - tokens + rate - 1) / rate;
+}
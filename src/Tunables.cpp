@@ -0,0 +1,42 @@
+#include "../include/Tunables.hpp"
+#include "../include/ServerConfig.hpp"
+
+Tunables::Tunables() : _timeout(TIMEOUT), _cgiTimeout(CGI_TIMEOUT), _clients(CLIENTS)
+{
+}
+
+Tunables& Tunables::getInstance()
+{
+	static Tunables instance;
+	return instance;
+}
+
+size_t Tunables::getTimeout() const
+{
+	return __atomic_load_n(&_timeout, __ATOMIC_RELAXED);
+}
+
+size_t Tunables::getCgiTimeout() const
+{
+	return __atomic_load_n(&_cgiTimeout, __ATOMIC_RELAXED);
+}
+
+size_t Tunables::getClients() const
+{
+	return __atomic_load_n(&_clients, __ATOMIC_RELAXED);
+}
+
+void Tunables::setTimeout(size_t seconds)
+{
+	__atomic_store_n(&_timeout, seconds, __ATOMIC_RELAXED);
+}
+
+void Tunables::setCgiTimeout(size_t seconds)
+{
+	__atomic_store_n(&_cgiTimeout, seconds, __ATOMIC_RELAXED);
+}
+
+void Tunables::setClients(size_t clients)
+{
+	__atomic_store_n(&_clients, clients, __ATOMIC_RELAXED);
+}
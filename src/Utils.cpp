@@ -5,6 +5,11 @@
 #include <cstring>
 #include <sys/time.h>
 #include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstddef>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 std::string Utils::getMimeType(const std::string &path)
 {
@@ -196,8 +201,9 @@ std::string Utils::getCurrentDate()
 {
 	char buffer[128];
 	time_t now = time(NULL);
-	struct tm* gmt = gmtime(&now);
-	strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", gmt);
+	struct tm gmt;
+	gmtime_r(&now, &gmt);
+	strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
 	return std::string(buffer);
 }
 
@@ -600,11 +606,12 @@ std::string Utils::createTempFile(const std::string& prefix, const std::string&
 	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
 		throw std::runtime_error("Failed to create directory: " + dir);
 
+	static unsigned long sequence = 0;
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 
 	std::stringstream ss;
-	ss << dir << "/" << prefix << "_" << getpid() << "_" << tv.tv_sec << "_" << tv.tv_usec;
+	ss << dir << "/" << prefix << "_" << getpid() << "_" << tv.tv_sec << "_" << tv.tv_usec << "_" << __sync_fetch_and_add(&sequence, 1);
 	return ss.str();
 }
 
@@ -632,3 +639,49 @@ std::vector<std::string> Utils::split(const std::string& str, char delimiter)
 
 	return tokens;
 }
+
+// unix listeners are keyed by path alone, IPv6 hosts are bracketed so the port stays unambiguous
+std::string Utils::getListenKey(const std::string& host, uint16_t port)
+{
+	if (host.compare(0, 5, "unix:") == 0)
+		return host;
+	if (host.find(':') != std::string::npos)
+		return "[" + host + "]:" + toString(port);
+	return host + ":" + toString(port);
+}
+
+bool Utils::getSocketAddress(int fd, std::string& host, uint16_t& port)
+{
+	struct sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	char buffer[INET6_ADDRSTRLEN];
+
+	if (getsockname(fd, reinterpret_cast<struct sockaddr*>(&address), &length) == -1)
+		return false;
+	if (address.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(&address);
+		if (!inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer)))
+			return false;
+		host = buffer;
+		port = ntohs(in->sin_port);
+		return true;
+	}
+	if (address.ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* in6 = reinterpret_cast<const struct sockaddr_in6*>(&address);
+		if (!inet_ntop(AF_INET6, &in6->sin6_addr, buffer, sizeof(buffer)))
+			return false;
+		host = buffer;
+		port = ntohs(in6->sin6_port);
+		return true;
+	}
+	if (address.ss_family == AF_UNIX && length > offsetof(struct sockaddr_un, sun_path))
+	{
+		const struct sockaddr_un* un = reinterpret_cast<const struct sockaddr_un*>(&address);
+		host = std::string("unix:") + std::string(un->sun_path, strnlen(un->sun_path, length - offsetof(struct sockaddr_un, sun_path)));
+		port = 0;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,102 @@
+#include "../include/VhostQuota.hpp"
+#include "../include/TimerWheel.hpp"
+#include "../include/Logger.hpp"
+
+VhostQuota::Usage::Usage() : connections(0), cgi(0), bodyBytes(0), rejected(0), lastReport(0)
+{
+}
+
+VhostQuota::Table::Table(size_t servers) : usage(servers), refs(1)
+{
+}
+
+void VhostQuota::Table::retain()
+{
+	__atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+}
+
+void VhostQuota::Table::release()
+{
+	if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0)
+		delete this;
+}
+
+VhostQuota::VhostQuota(const std::vector<ServerConfig>& servers, Table* table)
+	: _servers(servers),
+	_table(table)
+{
+	_table->retain();
+}
+
+VhostQuota::~VhostQuota()
+{
+	_table->release();
+}
+
+VhostQuota::Usage& VhostQuota::getUsage(const ServerConfig* server)
+{
+	return _table->usage[server - &_servers[0]];
+}
+
+size_t VhostQuota::getLimit(const ServerConfig& server, Resource resource)
+{
+	if (resource == CONNECTIONS)
+		return server.getMaxConnections();
+	if (resource == CGI)
+		return server.getMaxCgiProcesses();
+	return server.getMaxBodyInFlight();
+}
+
+size_t& VhostQuota::getCounter(Usage& usage, Resource resource)
+{
+	if (resource == CONNECTIONS)
+		return usage.connections;
+	if (resource == CGI)
+		return usage.cgi;
+	return usage.bodyBytes;
+}
+
+// loops race on the same counters, a reservation only lands if nobody moved them meanwhile
+bool VhostQuota::acquire(const ServerConfig* server, Resource resource, size_t amount)
+{
+	Usage& usage = getUsage(server);
+	size_t& counter = getCounter(usage, resource);
+	size_t limit = getLimit(*server, resource);
+	size_t current = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (limit > 0 && (current + amount > limit || current + amount < current))
+		{
+			__atomic_add_fetch(&usage.rejected, 1, __ATOMIC_RELAXED);
+			reportSaturation(*server, usage, resource);
+			return false;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&counter, &current, current + amount, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+void VhostQuota::release(const ServerConfig* server, Resource resource, size_t amount)
+{
+	size_t& counter = getCounter(getUsage(server), resource);
+	size_t current = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&counter, &current, current > amount ? current - amount : 0, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void VhostQuota::reportSaturation(const ServerConfig& server, Usage& usage, Resource resource)
+{
+	static const char* names[] = { "connections", "cgi processes", "body bytes" };
+	uint64_t now = TimerWheel::now();
+	uint64_t last = __atomic_load_n(&usage.lastReport, __ATOMIC_RELAXED);
+
+	if (now - last < 1000 || !__atomic_compare_exchange_n(&usage.lastReport, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	LOG_WARN("Server '" + server.getServerName() + "' saturated on " + names[resource]
+		+ " (connections " + Utils::toString(__atomic_load_n(&usage.connections, __ATOMIC_RELAXED)) + "/" + Utils::toString(getLimit(server, CONNECTIONS))
+		+ ", cgi " + Utils::toString(__atomic_load_n(&usage.cgi, __ATOMIC_RELAXED)) + "/" + Utils::toString(getLimit(server, CGI))
+		+ ", body bytes " + Utils::toString(__atomic_load_n(&usage.bodyBytes, __ATOMIC_RELAXED)) + "/" + Utils::toString(getLimit(server, BODY_BYTES))
+		+ "), " + Utils::toString(__atomic_load_n(&usage.rejected, __ATOMIC_RELAXED)) + " requests rejected so far");
+}
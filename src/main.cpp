@@ -1,18 +1,36 @@
 #include "../include/ServerManager.hpp"
 #include "../include/Logger.hpp"
+#include <signal.h>
 
 ServerManager* globalServer = NULL;
 
 void signal_handler(int signum) 
 {
-	(void) signum;
-	if (globalServer) 
+	if (!globalServer)
+		return;
+	if (signum == SIGHUP)
+		globalServer->requestReload();
+	else if (signum == SIGQUIT)
+		globalServer->requestDrain();
+	else if (signum == SIGUSR2)
+		globalServer->requestUpgrade();
+	else
 		globalServer->stop();
 }
 
 int main(int argc, char* argv[])
 {
-	signal(SIGINT, signal_handler);
+	struct sigaction sa;
+	std::memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	// OpenSSL writes with write(), a peer closing mid-response must not kill the process
+	signal(SIGPIPE, SIG_IGN);
 	try 
 	{
 		std::string configFile = "./config/default.conf";
@@ -20,7 +38,8 @@ int main(int argc, char* argv[])
 			configFile = argv[1];
 
 		ServerConfig config(configFile);
-		ServerManager serverManager(config.getServers());
+		ServerManager serverManager(config, configFile);
+		serverManager.setArguments(argv);
 		globalServer = &serverManager;
 
 		if (!serverManager.init()) 